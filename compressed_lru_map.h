@@ -0,0 +1,657 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides CompressedLruMap, an LruMap (see lru_map.h) of string
+ * values, such as serialized documents or blobs, that are kept compressed
+ * in memory, so that more of them fit in the same amount of RAM.
+ *
+ * Insert() compresses a value of at least 'threshold_bytes' with LzCodec,
+ * a byte oriented LZ77 codec that comes with this file. If the result is
+ * more than 'max_ratio' of the original, the value is stored as is; so are
+ * shorter values, which rarely compress well. The shared map stores every
+ * value as a CompressedValue. Compression happens outside of the lock.
+ *
+ * Find() copies the stored bytes under the lock and decompresses them
+ * after releasing it, into a caller provided string, or into a buffer of
+ * the calling thread, which is reused by its next Find() on any map of the
+ * same type. The buffers of a thread keep their memory from one Find() to
+ * the next, unless it grew beyond 1 MB. A value that
+ * fails to decompress, e.g. after it was corrupted in a second tier, is
+ * erased and the lookup is a miss.
+ *
+ * The number of values stored compressed and raw, the bytes saved and the
+ * time spent compressing and decompressing are reported by
+ * compression_stats(), to weigh the capacity gained against the CPU spent
+ * per lookup.
+ *
+ * The shared map is protected by a mutex of this class, so LruMapType is
+ * better instantiated with the default, non-locking, policies. Its value
+ * type must be CompressedValue.
+ */
+
+#ifndef _COMPRESSED_LRU_MAP_H_
+#define _COMPRESSED_LRU_MAP_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+#include "lru_map.h"
+
+// A byte oriented LZ77 codec, in the spirit of LZ4: fast, with a moderate
+// ratio, and no dependencies.
+//
+// The compressed form is a series of sequences, each a token byte, literals
+// and a match. The high nibble of the token is the number of literals and
+// the low nibble the length of the match minus 4; a nibble of 15 is
+// followed by bytes adding to it, up to the first one below 255. Then come
+// the literals, and a 2 byte little endian offset of the match, which is
+// copied from that far back in the output. The last sequence has literals
+// only, and ends the input.
+struct LzCodec {
+  // Replace the contents of 'out' with the compressed form of the 'size'
+  // bytes at 'data'.
+  static void Compress(const char *data, size_t size, std::string *out);
+
+  // Replace the contents of 'out' with the 'raw_size' bytes decompressed
+  // from the 'size' bytes at 'data'. Return false if those are not a valid
+  // compressed form of 'raw_size' bytes.
+  static bool Decompress(const char *data, size_t size, size_t raw_size,
+                         std::string *out);
+
+  // The most bytes that a compressed byte decompresses to; each length byte
+  // of 255 adds that many bytes to a match.
+  static constexpr size_t kMaxExpansion = 255;
+
+ private:
+  static constexpr int kHashBits = 12;
+  static constexpr size_t kMinMatch = 4;
+  static constexpr size_t kMaxOffset = 65535;
+
+  static uint32_t Load32(const uint8_t *ptr) {
+    uint32_t value;
+    std::memcpy(&value, ptr, sizeof value);
+    return value;
+  }
+
+  static uint32_t Hash(const uint32_t value) {
+    return (value * 2654435761u) >> (32 - kHashBits);
+  }
+
+  // Write 'length' beyond 15 to 'op', return the new end.
+  static uint8_t *PutLength(size_t length, uint8_t *op);
+
+  // Read a length beyond 15 into '*length'. Return false at the end.
+  static bool GetLength(const uint8_t **ip, const uint8_t *end,
+                        size_t *length);
+};
+
+// A string value as stored in a CompressedLruMap: either compressed by
+// LzCodec or raw.
+struct CompressedValue {
+  std::string bytes;
+  int64_t raw_size{0};
+  bool compressed{false};
+};
+
+std::ostream& operator<<(std::ostream& os, const CompressedValue& value);
+
+template <>
+struct LruMapPayload<CompressedValue> {
+  static int64_t Bytes(const CompressedValue& value) {
+    return LruMapPayload<std::string>::Bytes(value.bytes);
+  }
+};
+
+// A flag byte, the raw size and the stored bytes, for a SecondTierPolicy.
+// Parse() rejects a raw size that the stored bytes cannot have: a raw value
+// is stored as is, and a compressed one expands by at most
+// LzCodec::kMaxExpansion.
+template <>
+struct LruMapSerializer<CompressedValue> {
+  static void Append(const CompressedValue& value, std::string *out) {
+    out->push_back(value.compressed ? 1 : 0);
+    LruMapSerializer<int64_t>::Append(value.raw_size, out);
+    out->append(value.bytes);
+  }
+
+  static bool Parse(const char *data, size_t size, CompressedValue *value) {
+    const size_t header_size = 1 + sizeof(int64_t);
+    if (size < header_size || static_cast<uint8_t>(data[0]) > 1 ||
+        !LruMapSerializer<int64_t>::Parse(data + 1, sizeof(int64_t),
+                                          &value->raw_size)) {
+      return false;
+    }
+    const int64_t stored_size = size - header_size;
+    value->compressed = data[0] == 1;
+    if (value->raw_size < 0 ||
+        (!value->compressed && value->raw_size != stored_size) ||
+        (value->compressed &&
+         value->raw_size / LzCodec::kMaxExpansion >
+           static_cast<uint64_t>(stored_size))) {
+      return false;
+    }
+    value->bytes.assign(data + header_size, stored_size);
+    return true;
+  }
+};
+
+// Counters of a CompressedLruMap.
+struct CompressedLruMapStats {
+  int64_t num_compressed{0};      // # of values inserted compressed.
+  int64_t num_incompressible{0};  // # of values that did not compress well.
+  int64_t num_small{0};           // # of values below the threshold.
+  int64_t raw_bytes{0};           // # of bytes of values inserted compressed.
+  int64_t compressed_bytes{0};    // # of bytes those were compressed to.
+  int64_t compress_nsecs{0};      // Time spent compressing.
+  int64_t num_decompress{0};      // # of values decompressed by Find().
+  int64_t decompress_nsecs{0};    // Time spent decompressing.
+  int64_t num_corrupt{0};         // # of values that failed to, and erased.
+
+  // Return raw_bytes / compressed_bytes, 1 if nothing was compressed.
+  double CompressionRatio() const;
+
+  // Return raw_bytes - compressed_bytes.
+  int64_t BytesSaved() const;
+
+  std::string ToString() const;
+};
+
+template <typename KeyType,
+          class LruMapType = LruMap<KeyType, CompressedValue>>
+class CompressedLruMap {
+ public:
+  static_assert(std::is_same<typename LruMapType::mapped_type,
+                             CompressedValue>::value,
+                "LruMapType must map to CompressedValue");
+
+  // Construct an object whose shared map has the specified 'capacity'.
+  // Values of at least 'threshold_bytes' are stored compressed if that
+  // takes at most 'max_ratio' of their size.
+  explicit CompressedLruMap(int64_t capacity, int64_t threshold_bytes = 1024,
+                            double max_ratio = 0.875);
+
+  CompressedLruMap(const CompressedLruMap&) = delete;
+  CompressedLruMap& operator=(const CompressedLruMap&) = delete;
+
+  // Insert or update an entry, see LruMap::Insert().
+  void Insert(const KeyType& key, const std::string& value);
+
+  // Find the entry, if exists, for the key 'key' and decompress its value
+  // to '*value'. Return true iff found. An entry that fails to decompress
+  // is erased, counted in 'num_corrupt', and not found.
+  bool Find(const KeyType& key, std::string *value);
+
+  // Same as above, but decompress into a buffer of the calling thread.
+  // The buffer is shared by all CompressedLruMap objects of this type, so
+  // the returned pointer is invalidated by the next Find() of the thread
+  // on any of them, not only on this one. Return nullptr if not found.
+  const std::string *Find(const KeyType& key);
+
+  // Return true iff an entry with 'key' exists, false otherwise.
+  bool Exists(const KeyType& key) const;
+
+  // Erase entry with key 'key', if exists.
+  void Erase(const KeyType& key);
+
+  // Clear all entries in the map.
+  void Clear();
+
+  // Return the capacity of the shared map.
+  int64_t Capacity() const;
+
+  // Return the current number of entries in the shared map.
+  int64_t Size() const;
+
+  // Return the memory used by the shared map, whose payload is the stored,
+  // possibly compressed, bytes.
+  LruMapMemoryUsage MemoryUsage() const;
+
+  // Return a copy of the statistics of the shared map.
+  LruMapStats lru_map_stats() const;
+
+  // Return a copy of the compression statistics.
+  CompressedLruMapStats compression_stats() const;
+
+ private:
+  // The most memory a scratch string keeps between calls of Find(); one
+  // grown beyond it, by an unusually large value, is released.
+  static constexpr size_t kMaxRetainedBytes = 1 << 20;
+
+  // Scratch strings of the calling thread, for the stored bytes and for
+  // the result of Find().
+  struct LocalBuffers {
+    std::string stored;
+    std::string value;
+  };
+
+  static LocalBuffers& LocalBuffersOf();
+
+  // Return the nanoseconds elapsed since 'start'.
+  static int64_t NsecsSince(std::chrono::steady_clock::time_point start);
+
+  const int64_t threshold_bytes_;
+  const double max_ratio_;
+
+  std::atomic<int64_t> num_compressed_{0};
+  std::atomic<int64_t> num_incompressible_{0};
+  std::atomic<int64_t> num_small_{0};
+  std::atomic<int64_t> raw_bytes_{0};
+  std::atomic<int64_t> compressed_bytes_{0};
+  std::atomic<int64_t> compress_nsecs_{0};
+  std::atomic<int64_t> num_decompress_{0};
+  std::atomic<int64_t> decompress_nsecs_{0};
+  std::atomic<int64_t> num_corrupt_{0};
+
+  // Protects 'shared_map_'.
+  mutable std::mutex mutex_;
+  LruMapType shared_map_;
+};
+
+// ----------------------------------------------------------------------------
+
+inline uint8_t *
+LzCodec::PutLength(size_t length, uint8_t *op) {
+  length -= 15;
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = static_cast<uint8_t>(length);
+  return op;
+}
+
+// ----------------------------------------------------------------------------
+
+inline bool
+LzCodec::GetLength(const uint8_t **ip, const uint8_t *const end,
+                   size_t *const length) {
+  uint8_t byte;
+  do {
+    if (*ip == end) {
+      return false;
+    }
+    byte = *(*ip)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+inline void
+LzCodec::Compress(const char *const data, const size_t size,
+                  std::string *const out) {
+  // The worst case, all literals, adds a token and a length byte per 255.
+  out->resize(size + size / 255 + 16);
+  const uint8_t *const in = reinterpret_cast<const uint8_t *>(data);
+  uint8_t *const op_begin = reinterpret_cast<uint8_t *>(&(*out)[0]);
+  uint8_t *op = op_begin;
+
+  // The most recent position of every hashed 4 byte string. Stale or
+  // colliding entries are weeded out by comparing the bytes.
+  uint32_t table[1 << kHashBits];
+  std::memset(table, 0, sizeof table);
+
+  auto put_sequence = [&op, in](const size_t literal_begin,
+                                const size_t literal_end,
+                                const size_t match_length,
+                                const size_t offset) {
+    const size_t num_literals = literal_end - literal_begin;
+    uint8_t *const token = op++;
+    *token = static_cast<uint8_t>(std::min<size_t>(num_literals, 15) << 4);
+    if (num_literals >= 15) {
+      op = PutLength(num_literals, op);
+    }
+    std::memcpy(op, in + literal_begin, num_literals);
+    op += num_literals;
+    if (match_length == 0) {
+      return;
+    }
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    const size_t length = match_length - kMinMatch;
+    *token |= static_cast<uint8_t>(std::min<size_t>(length, 15));
+    if (length >= 15) {
+      op = PutLength(length, op);
+    }
+  };
+
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + kMinMatch <= size) {
+    const uint32_t word = Load32(in + pos);
+    uint32_t& slot = table[Hash(word)];
+    const size_t candidate = slot;
+    slot = static_cast<uint32_t>(pos);
+    if (candidate < pos && pos - candidate <= kMaxOffset &&
+        Load32(in + candidate) == word) {
+      size_t length = kMinMatch;
+      while (pos + length < size && in[candidate + length] == in[pos + length]) {
+        ++length;
+      }
+      put_sequence(anchor, pos, length, pos - candidate);
+      pos += length;
+      anchor = pos;
+    } else {
+      // Skip faster through data that does not compress.
+      pos += 1 + ((pos - anchor) >> 6);
+    }
+  }
+  put_sequence(anchor, size, 0, 0);
+  out->resize(op - op_begin);
+}
+
+// ----------------------------------------------------------------------------
+
+inline bool
+LzCodec::Decompress(const char *const data, const size_t size,
+                    const size_t raw_size, std::string *const out) {
+  // Checked before 'out' is sized, so a bad 'raw_size' is not allocated.
+  if (raw_size / kMaxExpansion > size) {
+    return false;
+  }
+  out->resize(raw_size);
+  const uint8_t *ip = reinterpret_cast<const uint8_t *>(data);
+  const uint8_t *const end = ip + size;
+  uint8_t *const op_begin = reinterpret_cast<uint8_t *>(&(*out)[0]);
+  uint8_t *const op_end = op_begin + raw_size;
+  uint8_t *op = op_begin;
+
+  while (ip != end) {
+    const uint8_t token = *ip++;
+    size_t num_literals = token >> 4;
+    if (num_literals == 15 && !GetLength(&ip, end, &num_literals)) {
+      return false;
+    }
+    if (num_literals > static_cast<size_t>(end - ip) ||
+        num_literals > static_cast<size_t>(op_end - op)) {
+      return false;
+    }
+    std::memcpy(op, ip, num_literals);
+    ip += num_literals;
+    op += num_literals;
+    if (ip == end) {
+      break;
+    }
+
+    if (end - ip < 2) {
+      return false;
+    }
+    const size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+    ip += 2;
+    size_t length = token & 15;
+    if (length == 15 && !GetLength(&ip, end, &length)) {
+      return false;
+    }
+    length += kMinMatch;
+    if (offset == 0 || offset > static_cast<size_t>(op - op_begin) ||
+        length > static_cast<size_t>(op_end - op)) {
+      return false;
+    }
+    // A match closer than its length overlaps the bytes it produces, and is
+    // copied forward a byte at a time.
+    const uint8_t *match = op - offset;
+    if (offset >= length) {
+      std::memcpy(op, match, length);
+      op += length;
+    } else {
+      for (size_t idx = 0; idx != length; ++idx) {
+        *op++ = *match++;
+      }
+    }
+  }
+  return op == op_end;
+}
+
+// ----------------------------------------------------------------------------
+
+inline std::ostream& operator<<(std::ostream& os,
+                                const CompressedValue& value) {
+  return os << (value.compressed ? "compressed " : "raw ")
+            << value.bytes.size() << "/" << value.raw_size << " bytes";
+}
+
+// ----------------------------------------------------------------------------
+
+inline double CompressedLruMapStats::CompressionRatio() const {
+  return compressed_bytes == 0 ?
+    1.0 : static_cast<double>(raw_bytes) / compressed_bytes;
+}
+
+// ----------------------------------------------------------------------------
+
+inline int64_t CompressedLruMapStats::BytesSaved() const {
+  return raw_bytes - compressed_bytes;
+}
+
+// ----------------------------------------------------------------------------
+
+inline std::string CompressedLruMapStats::ToString() const {
+  std::ostringstream oss;
+  oss << "num_compressed = " << num_compressed;
+  oss << ", num_incompressible = " << num_incompressible;
+  oss << ", num_small = " << num_small;
+  oss << ", raw_bytes = " << raw_bytes;
+  oss << ", compressed_bytes = " << compressed_bytes;
+  oss << ", ratio = " << CompressionRatio();
+  oss << ", compress_nsecs = " << compress_nsecs;
+  oss << ", num_decompress = " << num_decompress;
+  oss << ", decompress_nsecs = " << decompress_nsecs;
+  oss << ", num_corrupt = " << num_corrupt;
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+CompressedLruMap<KeyType, LruMapType>::CompressedLruMap(
+  const int64_t capacity, const int64_t threshold_bytes,
+  const double max_ratio) :
+  threshold_bytes_{threshold_bytes},
+  max_ratio_{max_ratio},
+  shared_map_{capacity} {
+  CHECK_GE(threshold_bytes_, 0);
+  CHECK(max_ratio_ > 0 && max_ratio_ <= 1) << "Bad ratio " << max_ratio_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+void
+CompressedLruMap<KeyType, LruMapType>::Insert(const KeyType& key,
+                                              const std::string& value) {
+  CompressedValue stored;
+  stored.raw_size = value.size();
+  if (static_cast<int64_t>(value.size()) < threshold_bytes_) {
+    num_small_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    const auto start = std::chrono::steady_clock::now();
+    LzCodec::Compress(value.data(), value.size(), &stored.bytes);
+    compress_nsecs_.fetch_add(NsecsSince(start), std::memory_order_relaxed);
+    if (stored.bytes.size() <= max_ratio_ * value.size()) {
+      stored.compressed = true;
+      stored.bytes.shrink_to_fit();
+      num_compressed_.fetch_add(1, std::memory_order_relaxed);
+      raw_bytes_.fetch_add(value.size(), std::memory_order_relaxed);
+      compressed_bytes_.fetch_add(stored.bytes.size(),
+                                  std::memory_order_relaxed);
+    } else {
+      num_incompressible_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  if (!stored.compressed) {
+    stored.bytes = value;
+  }
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  shared_map_.Insert(key, stored);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+bool
+CompressedLruMap<KeyType, LruMapType>::Find(const KeyType& key,
+                                            std::string *const value) {
+  std::string& stored_bytes = LocalBuffersOf().stored;
+  int64_t raw_size;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    const CompressedValue *stored = shared_map_.Find(key);
+    if (!stored) {
+      return false;
+    }
+    if (!stored->compressed) {
+      value->assign(stored->bytes);
+      return true;
+    }
+    stored_bytes.assign(stored->bytes);
+    raw_size = stored->raw_size;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const bool ok = LzCodec::Decompress(stored_bytes.data(),
+                                      stored_bytes.size(), raw_size, value);
+  num_decompress_.fetch_add(1, std::memory_order_relaxed);
+  decompress_nsecs_.fetch_add(NsecsSince(start), std::memory_order_relaxed);
+  if (!ok) {
+    LOG(WARNING) << "Erasing corrupt compressed value of " << key;
+    num_corrupt_.fetch_add(1, std::memory_order_relaxed);
+    value->clear();
+    std::lock_guard<std::mutex> lock{mutex_};
+    // Unless the entry was replaced in the meantime.
+    const CompressedValue *stored = shared_map_.Find(key);
+    if (stored && stored->compressed && stored->raw_size == raw_size &&
+        stored->bytes == stored_bytes) {
+      shared_map_.Erase(key);
+    }
+  }
+  if (stored_bytes.capacity() > kMaxRetainedBytes) {
+    std::string{}.swap(stored_bytes);
+  }
+  return ok;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+const std::string *
+CompressedLruMap<KeyType, LruMapType>::Find(const KeyType& key) {
+  // The previous result is invalidated here anyway.
+  std::string *const value = &LocalBuffersOf().value;
+  if (value->capacity() > kMaxRetainedBytes) {
+    std::string{}.swap(*value);
+  }
+  return Find(key, value) ? value : nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+bool
+CompressedLruMap<KeyType, LruMapType>::Exists(const KeyType& key) const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shared_map_.Exists(key);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+void
+CompressedLruMap<KeyType, LruMapType>::Erase(const KeyType& key) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  shared_map_.Erase(key);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+void
+CompressedLruMap<KeyType, LruMapType>::Clear() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  shared_map_.Clear();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+inline int64_t
+CompressedLruMap<KeyType, LruMapType>::Capacity() const {
+  return shared_map_.Capacity();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+inline int64_t
+CompressedLruMap<KeyType, LruMapType>::Size() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shared_map_.Size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+inline LruMapMemoryUsage
+CompressedLruMap<KeyType, LruMapType>::MemoryUsage() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shared_map_.MemoryUsage();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+inline LruMapStats
+CompressedLruMap<KeyType, LruMapType>::lru_map_stats() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shared_map_.lru_map_stats();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+CompressedLruMapStats
+CompressedLruMap<KeyType, LruMapType>::compression_stats() const {
+  CompressedLruMapStats stats;
+  stats.num_compressed = num_compressed_.load(std::memory_order_relaxed);
+  stats.num_incompressible =
+    num_incompressible_.load(std::memory_order_relaxed);
+  stats.num_small = num_small_.load(std::memory_order_relaxed);
+  stats.raw_bytes = raw_bytes_.load(std::memory_order_relaxed);
+  stats.compressed_bytes = compressed_bytes_.load(std::memory_order_relaxed);
+  stats.compress_nsecs = compress_nsecs_.load(std::memory_order_relaxed);
+  stats.num_decompress = num_decompress_.load(std::memory_order_relaxed);
+  stats.decompress_nsecs = decompress_nsecs_.load(std::memory_order_relaxed);
+  stats.num_corrupt = num_corrupt_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+typename CompressedLruMap<KeyType, LruMapType>::LocalBuffers&
+CompressedLruMap<KeyType, LruMapType>::LocalBuffersOf() {
+  static thread_local LocalBuffers local_buffers;
+  return local_buffers;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, class LruMapType>
+inline int64_t
+CompressedLruMap<KeyType, LruMapType>::NsecsSince(
+  const std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _COMPRESSED_LRU_MAP_H_
@@ -0,0 +1,686 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides FixedLruMap, a variant of LruMap (see lru_map.h) whose
+ * capacity is a compile time template parameter and which never allocates
+ * from the heap.
+ *
+ * LruMap is built from a std::list and a std::unordered_map. Every insertion
+ * allocates a list node and a map node, and every lookup chases pointers
+ * through a bucket, a map node and a list node. For small caches, say with
+ * 8 to 256 entries, that cost dominates the actual work.
+ *
+ * FixedLruMap keeps everything inline in the object:
+ *
+ *  - An array of 'kCapacity' entry slots holding the keys and values.
+ *
+ *  - Two arrays of small integer links, 'prev' and 'next', which thread the
+ *    occupied slots into the usage ordered list, the most recent one at
+ *    head and the least recent one at tail. The free slots are threaded
+ *    into a free list through 'next'.
+ *
+ *  - An array of one byte hash tags, one per slot. A lookup computes the
+ *    tag of the key and scans the tag array, 16 tags at a time with SSE2
+ *    when available, comparing keys only for the slots whose tag matches.
+ *    The scan is linear, which is the right trade off only for small
+ *    capacities.
+ *
+ * The API and the policies (LockingStoragePolicy, LockingPolicy,
+ * TimestampingPolicy, HitCountingPolicy and LoggingPolicy) are the same as
+ * those of LruMap. The PinningPolicy of LruMap is not offered, the values
+ * of small caches are meant to be copied out.
+ *
+ * KeyType must be hashable by std::hash and comparable by operator==.
+ */
+
+#ifndef _FIXED_LRU_MAP_H_
+#define _FIXED_LRU_MAP_H_
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "lru_map.h"
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy = LockStorageNone,
+          template <class> class LockingPolicy = LockNone,
+          template <class> class TimestampingPolicy = TimestampNone,
+          template <class> class HitCountingPolicy = HitCountDisabled,
+          template <class> class LoggingPolicy = LogEventNone>
+class FixedLruMap : public LockingStoragePolicy<void> {
+ public:
+  static_assert(kCapacity >= 1, "FixedLruMap capacity must be positive");
+  static_assert(kCapacity < (int64_t{1} << 31) - 1,
+                "FixedLruMap capacity is too large");
+
+  FixedLruMap();
+
+  ~FixedLruMap();
+
+  FixedLruMap(const FixedLruMap&) = delete;
+  FixedLruMap& operator=(const FixedLruMap&) = delete;
+
+  // Insert or update an entry with key 'key' and value 'value'.
+  //
+  // If an entry with 'key' already exists, then it is refreshed to be the most
+  // recent entry and the value of the entry would be the new 'value' supplied.
+  //
+  // If the number of entries had already reached the capacity, then the
+  // oldest entry is thrown away.
+  void Insert(const KeyType& key, const ValueType& value);
+
+  // Find the entry, if exists, for the key 'key'. The returned pointer may
+  // become stale through other operations, the client is required to protect
+  // against that, for example by copying the object elsewhere.
+  const ValueType *Find(const KeyType& key);
+
+  // Same as Find(), but without side effects: the entry is not moved to the
+  // front and neither the stats nor the HitCountingPolicy is updated.
+  const ValueType *Peek(const KeyType& key) const;
+
+  // Return true iff an entry with 'key' exists, false otherwise.
+  bool Exists(const KeyType& key) const;
+
+  // Erase entry with key 'key', if exists.
+  void Erase(const KeyType& key);
+
+  // Clear all entries in the map.
+  void Clear();
+
+  // Return the capacity, i.e. the maximum possible number of entries.
+  int64_t Capacity() const;
+
+  // Return the current number of entries.
+  int64_t Size() const;
+
+  // Audit all the entries and return true iff LRU property is satisfied,
+  // false otherwise. This is effective only if timestamps are maintained,
+  // for example by choosing the policy TimestampAll.
+  bool Valid() const;
+
+  // Return string representation of this object.
+  std::string ToString() const;
+
+  // Return a copy of the statistics.
+  LruMapStats lru_map_stats() const;
+
+ private:
+  // Sometimes a policy class is templated, but the template is not useful.
+  typedef void Dummy;
+
+  typedef FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+    LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>
+    ThisType;
+
+  friend struct LockingPolicy<ThisType>;
+
+  struct KeyValueEntry : public TimestampingPolicy<Dummy>,
+                                HitCountingPolicy<Dummy> {
+    KeyType key;
+    ValueType value;
+
+    KeyValueEntry(const KeyType& k, const ValueType& v) : key{k}, value{v} {}
+
+    std::string ToString() const {
+      std::ostringstream oss;
+      oss << key << "; " << value;
+      return oss.str() +
+             TimestampingPolicy<Dummy>::ToString() +
+             HitCountingPolicy<Dummy>::ToString() + "\n";
+    }
+  };
+
+  // The smallest unsigned type that can name every slot and 'kNil'.
+  typedef typename std::conditional<
+    (kCapacity < 255), uint8_t,
+    typename std::conditional<(kCapacity < 65535), uint16_t,
+                              uint32_t>::type>::type SlotIndex;
+
+  // The link value meaning 'no slot'.
+  static constexpr SlotIndex kNil = static_cast<SlotIndex>(kCapacity);
+
+  // The tag array is padded to whole 16 byte groups for the SIMD scan. The
+  // padding tags are kEmptyTag, which never matches a key.
+  static constexpr int64_t kNumTags = (kCapacity + 15) / 16 * 16;
+  static constexpr uint8_t kEmptyTag = 0;
+
+  // Iterates the entries from the most recent to the least recent, for the
+  // TimestampingPolicy audit.
+  class EntryIterator {
+   public:
+    EntryIterator(const ThisType *map, SlotIndex slot) : map_{map},
+                                                         slot_{slot} {}
+    const KeyValueEntry& operator*() const { return map_->EntryAt(slot_); }
+    EntryIterator& operator++() {
+      slot_ = map_->next_[slot_];
+      return *this;
+    }
+    bool operator!=(const EntryIterator& rhs) const {
+      return slot_ != rhs.slot_;
+    }
+   private:
+    const ThisType *map_;
+    SlotIndex slot_;
+  };
+
+  struct EntryRange {
+    const ThisType *map;
+    EntryIterator begin() const { return EntryIterator{map, map->head_}; }
+    EntryIterator end() const { return EntryIterator{map, kNil}; }
+  };
+
+ private:
+  // Return the tag of a key, the high bit is always set so that no tag
+  // equals kEmptyTag.
+  static uint8_t TagOf(const KeyType& key);
+
+  // Return the slot holding 'key', or kNil if there is none.
+  SlotIndex FindSlot(const KeyType& key) const;
+
+  KeyValueEntry& EntryAt(SlotIndex slot);
+  const KeyValueEntry& EntryAt(SlotIndex slot) const;
+
+  // Detach 'slot' from the usage list.
+  void Unlink(SlotIndex slot);
+
+  // Attach 'slot' at the head of the usage list.
+  void LinkFront(SlotIndex slot);
+
+  // Destroy the entry in 'slot' and return the slot to the free list.
+  void Release(SlotIndex slot);
+
+ private:
+  // Storage for the entries, constructed in place when a slot is occupied.
+  typename std::aligned_storage<sizeof(KeyValueEntry),
+                                alignof(KeyValueEntry)>::type
+    slots_[kCapacity];
+
+  // Hash tag of each slot, kEmptyTag for free slots.
+  alignas(16) uint8_t tags_[kNumTags];
+
+  // Usage list links, the most recent slot is 'head_'. Free slots are
+  // chained through 'next_' starting from 'free_head_'.
+  SlotIndex prev_[kCapacity];
+  SlotIndex next_[kCapacity];
+  SlotIndex head_{kNil};
+  SlotIndex tail_{kNil};
+  SlotIndex free_head_{0};
+
+  // The current number of entries.
+  int64_t size_{0};
+
+  // Cumulative lifetime stats, persist on Clear().
+  LruMapStats lru_stats_;
+};
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+constexpr typename FixedLruMap<KeyType, ValueType, kCapacity,
+  LockingStoragePolicy, LockingPolicy, TimestampingPolicy, HitCountingPolicy,
+  LoggingPolicy>::SlotIndex
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::kNil;
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  FixedLruMap() {
+  std::memset(tags_, kEmptyTag, sizeof tags_);
+  for (int64_t slot = 0; slot != kCapacity; ++slot) {
+    next_[slot] = static_cast<SlotIndex>(slot + 1);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  ~FixedLruMap() {
+  for (SlotIndex slot = head_; slot != kNil; slot = next_[slot]) {
+    EntryAt(slot).~KeyValueEntry();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+void
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Insert(const KeyType& key, const ValueType& value) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  SlotIndex slot = FindSlot(key);
+  if (slot != kNil) {
+    // If the key exists, then it is moved to the front of the list so that
+    // it is considered to be the most recent, and updated with the new value.
+    Unlink(slot);
+    LinkFront(slot);
+    EntryAt(slot).value = value;
+  } else {
+    // If all the slots are in use, then the least recent entry is thrown
+    // away to make room.
+    if (size_ == kCapacity) {
+      const SlotIndex oldest = tail_;
+      lru_stats_.num_overflow += 1;
+      LoggingPolicy<KeyValueEntry>::LogOverflow(EntryAt(oldest));
+      Unlink(oldest);
+      Release(oldest);
+    }
+
+    slot = free_head_;
+    DCHECK_NE(slot, kNil);
+    free_head_ = next_[slot];
+    new (&slots_[slot]) KeyValueEntry{key, value};
+    tags_[slot] = TagOf(key);
+    LinkFront(slot);
+    size_ += 1;
+  }
+
+  KeyValueEntry *recent_kv_entry = &EntryAt(slot);
+  LoggingPolicy<KeyValueEntry>::LogInsert(*recent_kv_entry);
+  TimestampingPolicy<KeyValueEntry>::UpdateModifyTimestamp(recent_kv_entry);
+
+  lru_stats_.num_insert += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+const ValueType *
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Find(const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_find += 1;
+
+  const SlotIndex slot = FindSlot(key);
+  if (slot == kNil) {
+    return nullptr;
+  }
+
+  if (slot != head_) {
+    Unlink(slot);
+    LinkFront(slot);
+  }
+
+  lru_stats_.num_find_ok += 1;
+  KeyValueEntry *found_kv_entry = &EntryAt(slot);
+  HitCountingPolicy<KeyValueEntry>::IncrementHitCount(found_kv_entry);
+  LoggingPolicy<KeyValueEntry>::LogFind(*found_kv_entry);
+  TimestampingPolicy<KeyValueEntry>::UpdateAccessTimestamp(found_kv_entry);
+
+  return &found_kv_entry->value;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+const ValueType *
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Peek(const KeyType& key) const {
+  LockingPolicy<ThisType> lock{this};
+  const SlotIndex slot = FindSlot(key);
+  return slot == kNil ? nullptr : &EntryAt(slot).value;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline bool
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Exists(const KeyType& key) const {
+  LockingPolicy<ThisType> lock{this};
+  return FindSlot(key) != kNil;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+void
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Erase(const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_erase += 1;
+
+  const SlotIndex slot = FindSlot(key);
+  if (slot == kNil) {
+    return;
+  }
+
+  LoggingPolicy<KeyValueEntry>::LogErase(EntryAt(slot));
+
+  Unlink(slot);
+  Release(slot);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+void
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Clear() {
+  LockingPolicy<ThisType> lock{this};
+  while (head_ != kNil) {
+    const SlotIndex slot = head_;
+    Unlink(slot);
+    Release(slot);
+  }
+  lru_stats_.num_clear += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline int64_t
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Capacity() const {
+  return kCapacity;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline int64_t
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Size() const {
+  LockingPolicy<ThisType> lock{this};
+  return size_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+bool
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Valid() const {
+  LockingPolicy<ThisType> lock{this};
+  return TimestampingPolicy<KeyValueEntry>::Valid(EntryRange{this});
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+std::string
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  ToString() const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  std::string result;
+  result += "key; value| atime; mtime\n";
+  for (SlotIndex slot = head_; slot != kNil; slot = next_[slot]) {
+    result += EntryAt(slot).ToString();
+  }
+  result += "\n";
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline LruMapStats
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  lru_map_stats() const {
+  return lru_stats_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline uint8_t
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  TagOf(const KeyType& key) {
+  // std::hash is the identity for integers on common implementations, so the
+  // bits are mixed before taking the top 7 of them.
+  const uint64_t hash =
+    static_cast<uint64_t>(std::hash<KeyType>()(key)) * 0x9E3779B97F4A7C15ull;
+  return static_cast<uint8_t>(0x80 | (hash >> 57));
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+typename FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  SlotIndex
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  FindSlot(const KeyType& key) const {
+  const uint8_t tag = TagOf(key);
+#if defined(__SSE2__)
+  const __m128i needle = _mm_set1_epi8(static_cast<char>(tag));
+  for (int64_t group = 0; group != kNumTags; group += 16) {
+    const __m128i tags = _mm_load_si128(
+      reinterpret_cast<const __m128i *>(&tags_[group]));
+    uint32_t matches = static_cast<uint32_t>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(tags, needle)));
+    while (matches != 0) {
+      const int64_t slot = group + __builtin_ctz(matches);
+      if (EntryAt(static_cast<SlotIndex>(slot)).key == key) {
+        return static_cast<SlotIndex>(slot);
+      }
+      matches &= matches - 1;
+    }
+  }
+#else
+  for (int64_t slot = 0; slot != kCapacity; ++slot) {
+    if (tags_[slot] == tag &&
+        EntryAt(static_cast<SlotIndex>(slot)).key == key) {
+      return static_cast<SlotIndex>(slot);
+    }
+  }
+#endif
+  return kNil;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline typename FixedLruMap<KeyType, ValueType, kCapacity,
+  LockingStoragePolicy, LockingPolicy, TimestampingPolicy, HitCountingPolicy,
+  LoggingPolicy>::KeyValueEntry&
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  EntryAt(const SlotIndex slot) {
+  return *reinterpret_cast<KeyValueEntry *>(&slots_[slot]);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline const typename FixedLruMap<KeyType, ValueType, kCapacity,
+  LockingStoragePolicy, LockingPolicy, TimestampingPolicy, HitCountingPolicy,
+  LoggingPolicy>::KeyValueEntry&
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  EntryAt(const SlotIndex slot) const {
+  return *reinterpret_cast<const KeyValueEntry *>(&slots_[slot]);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline void
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Unlink(const SlotIndex slot) {
+  const SlotIndex prev = prev_[slot];
+  const SlotIndex next = next_[slot];
+  if (prev != kNil) {
+    next_[prev] = next;
+  } else {
+    head_ = next;
+  }
+  if (next != kNil) {
+    prev_[next] = prev;
+  } else {
+    tail_ = prev;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline void
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  LinkFront(const SlotIndex slot) {
+  prev_[slot] = kNil;
+  next_[slot] = head_;
+  if (head_ != kNil) {
+    prev_[head_] = slot;
+  } else {
+    tail_ = slot;
+  }
+  head_ = slot;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int64_t kCapacity,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy>
+inline void
+FixedLruMap<KeyType, ValueType, kCapacity, LockingStoragePolicy,
+  LockingPolicy, TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  Release(const SlotIndex slot) {
+  EntryAt(slot).~KeyValueEntry();
+  tags_[slot] = kEmptyTag;
+  next_[slot] = free_head_;
+  free_head_ = slot;
+  size_ -= 1;
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _FIXED_LRU_MAP_H_
@@ -36,6 +36,9 @@
  *  4 Can we log when some or all of the interesting events among
  *    Insert|Overflow|Find|Erase occur?
  *
+ *  5 Can a client hold on to a found value, without copying it, while
+ *    other threads keep using the map?
+ *
  * All these are policies -- independent policies -- that a client may want.
  *
  * One way to address this is to roll out an Options struct with one or more
@@ -70,6 +73,10 @@
  *  - Timestamps (element access time, modify time)
  *  - HitCounter (element access counter)
  *  - Logging (logging API calls)
+ *  - Pinning (keeping looked up entries alive while handles exist)
+ *  - Indexing (the hash table that maps keys to entries)
+ *  - HotKeyTracking (estimating the most frequently accessed keys)
+ *  - SecondTier (keeping evicted entries in slower storage, e.g. a file)
  *
  * The default behavior of LruMap is to choose the default behavior for
  * each of the policies. The respective policy classes offering the
@@ -127,12 +134,32 @@
 #ifndef _LRU_MAP_H_
 #define _LRU_MAP_H_
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
 #include <limits>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // Necessary package: glog
 #include "glog/logging.h"
@@ -152,6 +179,19 @@ template <class T> struct HitCountDisabled;
 // Forward declaration for the default logging policy, see details below.
 template <class T> struct LogEventNone;
 
+// Forward declaration for the default pinning policy, see details below.
+template <class T> struct PinNone;
+
+// Forward declaration for the default indexing policy, see details below.
+template <class T> struct IndexStdUnorderedMap;
+
+// Forward declaration for the default hot key tracking policy, see details
+// below.
+template <class KeyT> struct HotKeyNone;
+
+// Forward declaration for the default second tier policy, see details below.
+template <class KeyValuePair> struct SecondTierNone;
+
 // A simple structure to count the number of times different APIs are called.
 struct LruMapStats {
   int64_t num_insert{0};    // # of calls to insert.
@@ -160,17 +200,205 @@ struct LruMapStats {
   int64_t num_find_ok{0};   // # of calls to find, only successful.
   int64_t num_erase{0};     // # of calls to erase, both successful and not.
   int64_t num_clear{0};     // # of calls to clear.
+  int64_t num_evict{0};     // # of entries evicted by EvictN|EvictColdest.
+  int64_t num_tier_write{0};    // # of evicted entries written to 2nd tier.
+  int64_t num_tier_find{0};     // # of find misses looked up in 2nd tier.
+  int64_t num_tier_find_ok{0};  // # of those found, and promoted.
+  int64_t tier_write_bytes{0};  // # of bytes written to 2nd tier.
+  int64_t tier_read_bytes{0};   // # of bytes read from 2nd tier.
+  int64_t num_tier_error{0};    // # of 2nd tier I/O errors and bad records.
+  int64_t num_tier_drop{0};     // # of evicted entries dropped, writer behind.
+  std::string ToString() const;
+};
+
+// The events that a HotKeyTrackingPolicy is told about.
+enum class HotKeyEvent {
+  kFindHit,   // Find() or Lookup() found the key.
+  kFindMiss,  // Find() or Lookup() did not find the key.
+  kInsert,    // Insert() of the key.
+};
+
+// A frequently accessed key, as estimated by a HotKeyTrackingPolicy.
+template <class KeyT>
+struct HotKey {
+  KeyT key;
+  int64_t count;       // Estimated # of events, at most 'error' too high.
+  int64_t error;       // Maximum overestimation of 'count'.
+  int64_t num_miss;    // Estimated # of kFindMiss events among 'count'.
+  int64_t num_insert;  // Estimated # of kInsert events among 'count'.
+};
+
+// How Clear() disposes of the entries.
+enum class LruMapClearMode {
+  // Destroy the entries while holding the lock. Slowest for the callers
+  // waiting on the lock, but all memory is released when Clear() returns.
+  kInline,
+
+  // Move the entries out in constant time under the lock, and destroy them
+  // in the calling thread after releasing the lock.
+  kOutsideLock,
+
+  // Move the entries out in constant time under the lock, and hand them to
+  // the background LruMapReclaimer thread. Clear() then takes constant time,
+  // independent of the size of the map.
+  kBackground,
+};
+
+// A process wide thread that destroys containers handed over to it, so that
+// freeing the memory of a large map does not stall its users.
+class LruMapReclaimer {
+ public:
+  // Type erased garbage, destroyed by the reclaimer thread.
+  struct Garbage {
+    virtual ~Garbage() {}
+  };
+
+  template <class T>
+  struct GarbageT : public Garbage {
+    template <class U>
+    explicit GarbageT(U&& garbage_in) : garbage(std::forward<U>(garbage_in)) {
+    }
+    T garbage;
+  };
+
+  // Return the reclaimer, starting its thread on the first call.
+  static LruMapReclaimer *Instance();
+
+  // Queue 'garbage', usually moved in, for destruction by the reclaimer
+  // thread.
+  template <class T>
+  void Dispose(T&& garbage);
+
+  // Wait until all the garbage queued so far has been destroyed.
+  void Drain();
+
+  // Return the total number of garbage objects destroyed.
+  int64_t num_reclaimed() const;
+
+  ~LruMapReclaimer();
+
+ private:
+  LruMapReclaimer();
+  LruMapReclaimer(const LruMapReclaimer&) = delete;
+  LruMapReclaimer& operator=(const LruMapReclaimer&) = delete;
+
+  void Run();
+
+  mutable std::mutex mutex_;
+  std::condition_variable queued_cv_;
+  std::condition_variable reclaimed_cv_;
+  std::deque<std::unique_ptr<Garbage>> queue_;
+  int64_t num_queued_{0};
+  int64_t num_reclaimed_{0};
+  bool stop_{false};
+  std::thread thread_;
+};
+
+// A breakdown of the memory used by a map, in bytes. The sizes of heap
+// blocks include the estimated overhead of the allocator, see
+// LruMapAllocationBytes().
+struct LruMapMemoryUsage {
+  int64_t num_entries{0};    // # of entries, including retired ones.
+  int64_t entry_bytes{0};    // Entry blocks: keys, values and list links.
+  int64_t policy_bytes{0};   // Per-entry policy data, within entry blocks.
+  int64_t index_bytes{0};    // Index nodes, including their copies of keys.
+  int64_t bucket_bytes{0};   // Bucket array, or slots and control words.
+  int64_t payload_bytes{0};  // Heap memory owned by keys and values.
+  int64_t object_bytes{0};   // The map object itself.
+
+  int64_t TotalBytes() const;
+
+  // Return the total bytes, excluding the map object, per entry.
+  double BytesPerEntry() const;
+
   std::string ToString() const;
 };
 
+// Return the estimated number of bytes consumed by a heap block of 'bytes':
+// the requested size, rounded up, plus the bookkeeping of the allocator.
+// The estimate follows glibc malloc: a header of one word and 16 byte
+// granularity with a minimum of 32 bytes.
+inline int64_t LruMapAllocationBytes(const size_t bytes) {
+  return std::max<int64_t>(32, (bytes + sizeof(size_t) + 15) / 16 * 16);
+}
+
+// The heap memory owned by an object of type T, beyond sizeof(T), in
+// bytes. The default reports none; clients may specialize this for their
+// key and value types to have MemoryUsage() account for it.
+template <class T>
+struct LruMapPayload {
+  static int64_t Bytes(const T&) { return 0; }
+};
+
+template <>
+struct LruMapPayload<std::string> {
+  static int64_t Bytes(const std::string& str) {
+    // Short strings are stored within the object itself.
+    const char *data = str.data();
+    const char *object = reinterpret_cast<const char *>(&str);
+    if (data >= object && data < object + sizeof str) {
+      return 0;
+    }
+    return LruMapAllocationBytes(str.capacity() + 1);
+  }
+};
+
+// Conversion of an object of type T to and from bytes, for storage outside
+// of memory, see SecondTierFile. The default copies the object
+// representation, so T must be trivially copyable. Clients may specialize
+// this for other key and value types.
+template <class T>
+struct LruMapSerializer {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "Specialize LruMapSerializer for this type");
+
+  // Append the bytes of 'obj' to 'out'.
+  static void Append(const T& obj, std::string *out) {
+    out->append(reinterpret_cast<const char *>(&obj), sizeof(T));
+  }
+
+  // Restore 'obj' from the 'size' bytes at 'data'. Return false if they
+  // are not a valid representation.
+  static bool Parse(const char *data, size_t size, T *obj) {
+    if (size != sizeof(T)) {
+      return false;
+    }
+    std::memcpy(obj, data, sizeof(T));
+    return true;
+  }
+};
+
+template <>
+struct LruMapSerializer<std::string> {
+  static void Append(const std::string& str, std::string *out) {
+    out->append(str);
+  }
+
+  static bool Parse(const char *data, size_t size, std::string *str) {
+    str->assign(data, size);
+    return true;
+  }
+};
+
 template <typename KeyType, typename ValueType,
           template <class> class LockingStoragePolicy = LockStorageNone,
           template <class> class LockingPolicy = LockNone,
           template <class> class TimestampingPolicy = TimestampNone,
           template <class> class HitCountingPolicy = HitCountDisabled,
-          template <class> class LoggingPolicy = LogEventNone>
-class LruMap : public LockingStoragePolicy<void> {
+          template <class> class LoggingPolicy = LogEventNone,
+          template <class> class PinningPolicy = PinNone,
+          template <class> class IndexingPolicy = IndexStdUnorderedMap,
+          template <class> class HotKeyTrackingPolicy = HotKeyNone,
+          template <class> class SecondTierPolicy = SecondTierNone>
+class LruMap : public LockingStoragePolicy<void>,
+               public HotKeyTrackingPolicy<KeyType>,
+               public SecondTierPolicy<std::pair<KeyType, ValueType>> {
  public:
+  typedef KeyType key_type;
+  typedef ValueType mapped_type;
+
+  class ValueHandle;
+
   // Construct an object with specified 'capacity'.
   explicit LruMap(const int64_t capacity);
 
@@ -190,14 +418,32 @@ class LruMap : public LockingStoragePolicy<void> {
   // against that, for example by copying the object elsewhere.
   const ValueType *Find(const KeyType& key);
 
+  // Same as Find(), but the result is a handle that pins the entry. The value
+  // referred to by a pinned entry is neither modified nor destroyed until the
+  // last handle to it is released, so it can be read without copying and
+  // without holding any lock. An Insert() for a pinned key installs a new
+  // entry and leaves the pinned one intact. What eviction does with a pinned
+  // entry is decided by the PinningPolicy, see PinKeepAlive and PinResident.
+  // All handles must be released before the map is destroyed.
+  // Requires a PinningPolicy other than PinNone.
+  ValueHandle Lookup(const KeyType& key);
+
+  // Same as Find(), but without side effects: the entry is not moved to the
+  // front and neither the stats nor the HitCountingPolicy is updated.
+  const ValueType *Peek(const KeyType& key) const;
+
   // Return true iff an entry with 'key' exists, false otherwise.
   bool Exists(const KeyType& key) const;
 
   // Erase entry with key 'key', if exists.
   void Erase(const KeyType& key);
 
-  // Clear all entries in the map and release all memory.
-  void Clear();
+  // Clear all entries in the map and release all memory. With 'mode' other
+  // than kInline, the lock is held for constant time, independent of the
+  // number of entries, and the memory is released later, see
+  // LruMapClearMode. If the PinningPolicy is enabled then the entries are
+  // still scanned under the lock for the pinned ones, which outlive Clear().
+  void Clear(LruMapClearMode mode = LruMapClearMode::kInline);
 
   // Return the capacity, i.e. the maximum possible number of entries.
   int64_t Capacity() const;
@@ -210,24 +456,73 @@ class LruMap : public LockingStoragePolicy<void> {
   // for example by choosing the policy TimestampAll.
   bool Valid() const;
 
+  // Call 'visitor(key, value)' for every entry, from the least recent to the
+  // most recent, without promoting any of them. The lock is held for at most
+  // 'chunk_size' entries at a time. Between the chunks the traversal resumes
+  // from the last visited key; if that key was meanwhile erased or moved to
+  // the front then the traversal ends early. Concurrent updates may cause an
+  // entry to be visited twice, but never more than Size() visits are made.
+  template <typename Visitor>
+  void ForEachInLruOrder(Visitor visitor,
+                         int64_t chunk_size = kVisitChunkSize) const;
+
+  // Same as ForEachInLruOrder(), but visit only the 'n' most recent entries,
+  // from the most recent to the least recent.
+  template <typename Visitor>
+  void ForEachMostRecent(int64_t n, Visitor visitor,
+                         int64_t chunk_size = kVisitChunkSize) const;
+
+  // Evict up to 'n' of the least recent entries, as if they overflowed.
+  // The evicted values are destroyed after the lock is released.
+  // Return the number of evicted entries.
+  int64_t EvictN(int64_t n);
+
+  // Evict the least recent entries for as long as 'predicate(key, value)'
+  // returns true, stopping at the first entry for which it returns false.
+  // The evicted values are destroyed after the lock is released.
+  // Return the number of evicted entries.
+  template <typename Predicate>
+  int64_t EvictColdest(Predicate predicate);
+
+  // Let Insert() grow the map up to 'overflow_limit' entries, at least the
+  // capacity, before it evicts. The entries beyond the capacity are meant
+  // to be evicted in the background, see LruMapEvictor, while the limit
+  // keeps the size bounded if that falls behind.
+  void SetOverflowLimit(int64_t overflow_limit);
+
+  // Return the number of entries beyond which Insert() evicts.
+  int64_t OverflowLimit() const;
+
   // Return string representation of this object.
   std::string ToString() const;
 
   // Return a copy of the statistics.
   LruMapStats lru_map_stats() const;
 
+  // Return the memory used by this object, in O(1) time.
+  LruMapMemoryUsage MemoryUsage() const;
+
+  // Return up to 'n' of the most frequently accessed keys, most frequent
+  // first, as estimated by the HotKeyTrackingPolicy. Keys are tracked
+  // whether or not they are in the map, so keys that keep missing show up
+  // too. Empty unless a policy such as HotKeySpaceSaving is chosen.
+  std::vector<HotKey<KeyType>> HotKeys(int64_t n) const;
+
  private:
   // Sometimes a policy class is templated, but the template is not useful.
   typedef void Dummy;
 
   typedef LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-    TimestampingPolicy, HitCountingPolicy, LoggingPolicy> ThisType;
+    TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+    IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy> ThisType;
 
   friend struct LockingPolicy<ThisType>;
 
   template <typename KeyT, typename ValueT>
   struct KeyValueT : public TimestampingPolicy<Dummy>,
-                            HitCountingPolicy<Dummy> {
+                            HitCountingPolicy<Dummy>,
+                            PinningPolicy<Dummy>,
+                            IndexingPolicy<Dummy> {
     KeyT key;
     ValueT value;
 
@@ -238,24 +533,85 @@ class LruMap : public LockingStoragePolicy<void> {
       oss << key << "; " << value;
       return oss.str() +
              TimestampingPolicy<Dummy>::ToString() +
-             HitCountingPolicy<Dummy>::ToString() + "\n";
+             HitCountingPolicy<Dummy>::ToString() +
+             PinningPolicy<Dummy>::ToString() + "\n";
     }
   };
 
   typedef KeyValueT<KeyType, ValueType> KeyValueEntry;
   typedef std::list<KeyValueEntry> ItemList;
   typedef typename ItemList::iterator ItemListIter;
-  typedef std::unordered_map<KeyType, ItemListIter> ItemMap;
+  typedef typename IndexingPolicy<Dummy>::template Map<KeyType, ItemListIter>
+    ItemMap;
   typedef typename ItemMap::iterator ItemMapIter;
 
+  typedef SecondTierPolicy<std::pair<KeyType, ValueType>> SecondTierType;
+
  private:
+  // Default number of entries visited per lock acquisition by ForEach*().
+  static constexpr int64_t kVisitChunkSize = 1024;
+
   // Implementation of Size() without applying LockingPolicy.
   int64_t SizePrivate() const;
 
+  // Return the heap memory owned by the key and the value of 'kv_entry'.
+  static int64_t PayloadBytes(const KeyValueEntry& kv_entry);
+
+  // Implementation of ForEach*() in the direction 'from_most_recent'.
+  template <typename Visitor>
+  void ForEachPrivate(bool from_most_recent, int64_t n, Visitor visitor,
+                      int64_t chunk_size) const;
+
+  // Return the least recent entry that the PinningPolicy allows to be
+  // evicted, not counting the 'num_newest' most recent entries. Return
+  // lru_list_.end() if there is none. The entries stepped over, which are
+  // pinned, are moved to just behind the 'num_newest' ones, so that the
+  // next search does not step over them again.
+  ItemListIter OldestEvictablePrivate(int64_t num_newest);
+
+  // Evict the entry at 'list_it'. If 'victims' is not null then the entry
+  // is moved there instead of being destroyed.
+  void EvictPrivate(ItemListIter list_it, ItemList *victims);
+
+  // Implementation of Find() without applying LockingPolicy. Return the
+  // entry, now the most recent one, or lru_list_.end() if not found. The
+  // entries evicted to make room for one promoted from the second tier are
+  // moved to 'victims'.
+  ItemListIter FindPrivate(const KeyType& key, ItemList *victims);
+
+  // Implementation of Insert() without applying LockingPolicy, the stats
+  // and the HotKeyTrackingPolicy. If 'victims' is not null then the entries
+  // evicted on overflow are moved there instead of being destroyed.
+  void InsertPrivate(const KeyType& key, const ValueType& value,
+                     ItemList *victims);
+
+  // Remove the entry at 'map_it' from the map and the list, see
+  // UnlinkPrivate() for what happens to the entry.
+  void RemovePrivate(ItemMapIter map_it, ItemList *victims = nullptr);
+
+  // Remove the entry at 'list_it', which is no longer in the map, from the
+  // list. If the entry is pinned then it is moved to 'retired_list_' instead
+  // of being destroyed. Otherwise, if 'victims' is not null then it is moved
+  // there.
+  void UnlinkPrivate(ItemListIter list_it, ItemList *victims);
+
+  // Implementation of Clear() without applying LockingPolicy. Unless 'mode'
+  // is kInline, the entries are swapped into 'old_list' and 'old_map'.
+  void ClearPrivate(LruMapClearMode mode, ItemList *old_list,
+                    ItemMap *old_map);
+
+  // Pin and unpin the entry at 'list_it', on behalf of a ValueHandle.
+  void PinEntry(ItemListIter list_it);
+  void UnpinEntry(ItemListIter list_it);
+
  private:
   // The capacity, i.e. maximum number of elements at a time.
   const int64_t capacity_{0};
 
+  // The number of elements beyond which Insert() evicts, see
+  // SetOverflowLimit().
+  int64_t overflow_limit_{0};
+
   // Cumulative lifetime stats, persist on Clear().
   LruMapStats lru_stats_;
 
@@ -264,6 +620,87 @@ class LruMap : public LockingStoragePolicy<void> {
 
   // Map element keys to element values.
   ItemMap lru_key_map_;
+
+  // Entries that were removed from the map while pinned, they are destroyed
+  // when the last ValueHandle referring to them is released.
+  ItemList retired_list_;
+
+  // Heap memory owned by the keys and values of all entries, including the
+  // retired ones, per LruMapPayload.
+  int64_t payload_bytes_{0};
+
+  // Heap memory owned by the keys of the entries in the map, which the
+  // index may hold copies of.
+  int64_t key_payload_bytes_{0};
+};
+
+// ----------------------------------------------------------------------------
+
+// A reference counted handle to a value in the map, see LruMap::Lookup().
+// A default constructed handle, or the result of an unsuccessful Lookup(),
+// is empty and evaluates to false.
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+class LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ValueHandle {
+ public:
+  ValueHandle() = default;
+
+  ValueHandle(const ValueHandle& other) : owner_{other.owner_},
+                                          list_it_{other.list_it_} {
+    if (owner_) {
+      owner_->PinEntry(list_it_);
+    }
+  }
+
+  ValueHandle(ValueHandle&& other) : owner_{other.owner_},
+                                     list_it_{other.list_it_} {
+    other.owner_ = nullptr;
+  }
+
+  ValueHandle& operator=(ValueHandle other) {
+    std::swap(owner_, other.owner_);
+    std::swap(list_it_, other.list_it_);
+    return *this;
+  }
+
+  ~ValueHandle() { Reset(); }
+
+  // Release the pin, if any, and make this handle empty.
+  void Reset() {
+    if (owner_) {
+      owner_->UnpinEntry(list_it_);
+      owner_ = nullptr;
+    }
+  }
+
+  explicit operator bool() const { return owner_ != nullptr; }
+
+  const ValueType *get() const {
+    return owner_ ? &list_it_->value : nullptr;
+  }
+  const ValueType& operator*() const { return list_it_->value; }
+  const ValueType *operator->() const { return &list_it_->value; }
+
+ private:
+  friend class LruMap;
+
+  // Construct a handle for an entry that is already pinned by the caller.
+  ValueHandle(ThisType *owner, ItemListIter list_it) : owner_{owner},
+                                                       list_it_{list_it} {}
+
+  ThisType *owner_{nullptr};
+  ItemListIter list_it_;
 };
 
 // ----------------------------------------------------------------------------
@@ -273,10 +710,17 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
-  LruMap(const int64_t capacity) : capacity_{capacity} {
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  LruMap(const int64_t capacity) :
+  capacity_{capacity},
+  overflow_limit_{capacity} {
   CHECK_GE(capacity, 1);
 
   LOG(INFO) << "LruMap size of types: KeyType = " << sizeof(KeyType)
@@ -296,27 +740,74 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 void
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::Insert(
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::Insert(
   const KeyType& key, const ValueType& value) {
+  // Declared before the lock, so that the entries evicted on overflow are
+  // destroyed after the lock is released.
+  ItemList victims;
 
   LockingPolicy<ThisType> lock{this};
 
+  // A copy in the second tier, if any, is now stale.
+  SecondTierType::EraseFromSecondTier(key);
+  InsertPrivate(key, value, &victims);
+
+  HotKeyTrackingPolicy<KeyType>::TrackHotKey(key, HotKeyEvent::kInsert);
+  lru_stats_.num_insert += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  InsertPrivate(const KeyType& key, const ValueType& value,
+                ItemList *const victims) {
   ItemMapIter map_it = lru_key_map_.find(key);
+  if (map_it != lru_key_map_.end() &&
+      PinningPolicy<KeyValueEntry>::IsPinned(&*map_it->second)) {
+    // The existing value is in use through a ValueHandle and must not be
+    // modified, so the entry is retired and a fresh one is inserted below.
+    RemovePrivate(map_it);
+    map_it = lru_key_map_.end();
+  }
+
   if (map_it != lru_key_map_.end()) {
     // If the key exists, then it is moved to the front of the list so that
     // it is considered to be the most recent.
     lru_list_.splice(lru_list_.begin(), lru_list_, map_it->second);
 
     // Update with the new value.
-    lru_list_.begin()->value = value;
+    ValueType& current_value = lru_list_.begin()->value;
+    payload_bytes_ -= LruMapPayload<ValueType>::Bytes(current_value);
+    current_value = value;
+    payload_bytes_ += LruMapPayload<ValueType>::Bytes(current_value);
   } else {
     // If the key does not exist, then a new entry is constructed and inserted
     // to the front of the list.
     const KeyValueEntry kv_entry{key, value};
     lru_list_.push_front(kv_entry);
+    payload_bytes_ += PayloadBytes(kv_entry);
+    key_payload_bytes_ += LruMapPayload<KeyType>::Bytes(key);
 
     // Also, a new entry is inserted into the map such that the key points to
     // the corresponding (now, first) element in the list.
@@ -331,19 +822,19 @@ LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
   LoggingPolicy<KeyValueEntry>::LogInsert(*recent_kv_entry);
   TimestampingPolicy<KeyValueEntry>::UpdateModifyTimestamp(recent_kv_entry);
 
-  // If size exceeds capacity, then throw away the least recent entry.
-  if (SizePrivate() > capacity_) {
-    ItemListIter oldest = lru_list_.end();
-    --oldest;
-    KeyValueEntry *oldest_kv_entry = &*oldest;
+  // While size exceeds the overflow limit, by default the capacity, throw
+  // away the least recent entry that the PinningPolicy allows to be evicted.
+  // If there is none, other than the entry just inserted, then the size
+  // stays above the limit for now. Without pinning, and unless the limit
+  // was just lowered, at most one entry is thrown away.
+  while (SizePrivate() > overflow_limit_) {
+    const ItemListIter oldest = OldestEvictablePrivate(1);
+    if (oldest == lru_list_.end()) {
+      break;
+    }
     lru_stats_.num_overflow += 1;
-    LoggingPolicy<KeyValueEntry>::LogOverflow(*oldest_kv_entry);
-
-    lru_key_map_.erase(oldest->key);
-    lru_list_.pop_back();
+    EvictPrivate(oldest, victims);
   }
-
-  lru_stats_.num_insert += 1;
 }
 
 // ----------------------------------------------------------------------------
@@ -353,22 +844,104 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 const ValueType *
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
   Find(const KeyType& key) {
+  // Declared before the lock, so that the entries evicted by a promotion
+  // from the second tier are destroyed after the lock is released.
+  ItemList victims;
+
+  LockingPolicy<ThisType> lock{this};
+
+  const ItemListIter list_it = FindPrivate(key, &victims);
+  if (list_it == lru_list_.end()) {
+    return nullptr;
+  }
+  return &list_it->value;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+typename LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ValueHandle
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  Lookup(const KeyType& key) {
+
+  static_assert(PinningPolicy<Dummy>::kEnabled,
+                "Lookup() requires a PinningPolicy, e.g. PinKeepAlive");
+
+  // Declared before the lock, see Find().
+  ItemList victims;
 
   LockingPolicy<ThisType> lock{this};
 
+  const ItemListIter list_it = FindPrivate(key, &victims);
+  if (list_it == lru_list_.end()) {
+    return ValueHandle{};
+  }
+  PinningPolicy<KeyValueEntry>::Pin(&*list_it);
+  return ValueHandle{this, list_it};
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+typename LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ItemListIter
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  FindPrivate(const KeyType& key, ItemList *const victims) {
+
   lru_stats_.num_find += 1;
 
   ItemMapIter map_it = lru_key_map_.find(key);
   if (map_it == lru_key_map_.end()) {
-    return nullptr;
+    HotKeyTrackingPolicy<KeyType>::TrackHotKey(key, HotKeyEvent::kFindMiss);
+    // Promote the entry from the second tier, if it is there.
+    const bool promoted = SecondTierType::FindInSecondTier(
+      key, &lru_stats_, [this, &key, victims](const ValueType& value) {
+        InsertPrivate(key, value, victims);
+      });
+    if (!promoted) {
+      return lru_list_.end();
+    }
+  } else {
+    HotKeyTrackingPolicy<KeyType>::TrackHotKey(key, HotKeyEvent::kFindHit);
+    lru_list_.splice(lru_list_.begin(), lru_list_, map_it->second);
   }
-
-  lru_list_.splice(lru_list_.begin(), lru_list_, map_it->second);
   DCHECK(lru_list_.begin()->key == key);
 
   lru_stats_.num_find_ok += 1;
@@ -377,7 +950,32 @@ LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
   LoggingPolicy<KeyValueEntry>::LogFind(*found_kv_entry);
   TimestampingPolicy<KeyValueEntry>::UpdateAccessTimestamp(found_kv_entry);
 
-  return &lru_list_.begin()->value;
+  return lru_list_.begin();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+const ValueType *
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  Peek(const KeyType& key) const {
+  LockingPolicy<ThisType> lock{this};
+  const auto map_it = lru_key_map_.find(key);
+  if (map_it == lru_key_map_.end()) {
+    return nullptr;
+  }
+  return &map_it->second->value;
 }
 
 // ----------------------------------------------------------------------------
@@ -387,10 +985,15 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 inline bool
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::Exists(
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::Exists(
   const KeyType& key) const {
   LockingPolicy<ThisType> lock{this};
   return lru_key_map_.find(key) != lru_key_map_.end();
@@ -403,15 +1006,21 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 void
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
   Erase(const KeyType& key) {
 
   LockingPolicy<ThisType> lock{this};
 
   lru_stats_.num_erase += 1;
+  SecondTierType::EraseFromSecondTier(key);
 
   ItemMapIter map_it = lru_key_map_.find(key);
   if (map_it == lru_key_map_.end()) {
@@ -420,8 +1029,7 @@ LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
 
   LoggingPolicy<KeyValueEntry>::LogErase(*map_it->second);
 
-  lru_list_.erase(map_it->second);
-  lru_key_map_.erase(map_it);
+  RemovePrivate(map_it);
 }
 
 // ----------------------------------------------------------------------------
@@ -431,14 +1039,74 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 void
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::Clear() {
-  LockingPolicy<ThisType> lock{this};
-  lru_list_.clear();
-  lru_key_map_.clear();
-  lru_key_map_.reserve(0);
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  Clear(const LruMapClearMode mode) {
+  // With kOutsideLock, these are destroyed after the lock is released.
+  ItemList old_list;
+  ItemMap old_map;
+  {
+    LockingPolicy<ThisType> lock{this};
+    ClearPrivate(mode, &old_list, &old_map);
+  }
+  if (mode == LruMapClearMode::kBackground) {
+    LruMapReclaimer *const reclaimer = LruMapReclaimer::Instance();
+    reclaimer->Dispose(std::move(old_map));
+    reclaimer->Dispose(std::move(old_list));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ClearPrivate(const LruMapClearMode mode, ItemList *const old_list,
+               ItemMap *const old_map) {
+  SecondTierType::ClearSecondTier();
+  if (PinningPolicy<Dummy>::kEnabled) {
+    // Pinned entries outlive Clear(), they are retired until released.
+    ItemListIter list_it = lru_list_.begin();
+    while (list_it != lru_list_.end()) {
+      const ItemListIter next_it = std::next(list_it);
+      if (PinningPolicy<KeyValueEntry>::IsPinned(&*list_it)) {
+        PinningPolicy<KeyValueEntry>::Retire(&*list_it);
+        retired_list_.splice(retired_list_.begin(), lru_list_, list_it);
+      }
+      list_it = next_it;
+    }
+  }
+  if (mode == LruMapClearMode::kInline) {
+    lru_list_.clear();
+    lru_key_map_.clear();
+    lru_key_map_.reserve(0);
+  } else {
+    lru_key_map_.swap(*old_map);
+    lru_list_.swap(*old_list);
+  }
+  payload_bytes_ = 0;
+  for (const KeyValueEntry& kv_entry : retired_list_) {
+    payload_bytes_ += PayloadBytes(kv_entry);
+  }
+  key_payload_bytes_ = 0;
   lru_stats_.num_clear += 1;
 }
 
@@ -449,10 +1117,15 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 inline int64_t
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
   Capacity() const {
   return capacity_;
 }
@@ -464,10 +1137,59 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  SetOverflowLimit(const int64_t overflow_limit) {
+  CHECK_GE(overflow_limit, capacity_);
+  LockingPolicy<ThisType> lock{this};
+  overflow_limit_ = overflow_limit;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+int64_t
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  OverflowLimit() const {
+  LockingPolicy<ThisType> lock{this};
+  return overflow_limit_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 inline int64_t
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::Size() const {
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  Size() const {
   LockingPolicy<ThisType> lock{this};
   return SizePrivate();
 }
@@ -479,10 +1201,16 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
 inline int64_t
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::SizePrivate() const {
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  SizePrivate() const {
   DCHECK_EQ(lru_list_.size(), lru_key_map_.size());
   return lru_list_.size();
 }
@@ -494,38 +1222,71 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
-bool
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+inline int64_t
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::Valid() const {
-  LockingPolicy<ThisType> lock{this};
-  return TimestampingPolicy<KeyValueEntry>::Valid(lru_list_);
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  PayloadBytes(const KeyValueEntry& kv_entry) {
+  return LruMapPayload<KeyType>::Bytes(kv_entry.key) +
+         LruMapPayload<ValueType>::Bytes(kv_entry.value);
 }
 
 // ----------------------------------------------------------------------------
+
 template <typename KeyType, typename ValueType,
           template <class> class LockingStoragePolicy,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
-std::string
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
-  ToString() const {
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  RemovePrivate(const ItemMapIter map_it, ItemList *const victims) {
+  const ItemListIter list_it = map_it->second;
+  lru_key_map_.erase(map_it);
+  UnlinkPrivate(list_it, victims);
+}
 
-  LockingPolicy<ThisType> lock{this};
+// ----------------------------------------------------------------------------
 
-  std::string result;
-  // Heuristic reserve, the excess is trimmed before returning.
-  result.reserve(lru_list_.size() * 32);
-  result += "key; value| atime; mtime\n";
-  for (const KeyValueEntry& kv_entry : lru_list_) {
-    result += kv_entry.ToString();
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  UnlinkPrivate(const ItemListIter list_it, ItemList *const victims) {
+  key_payload_bytes_ -= LruMapPayload<KeyType>::Bytes(list_it->key);
+  if (PinningPolicy<KeyValueEntry>::IsPinned(&*list_it)) {
+    PinningPolicy<KeyValueEntry>::Retire(&*list_it);
+    retired_list_.splice(retired_list_.begin(), lru_list_, list_it);
+    return;
+  }
+  payload_bytes_ -= PayloadBytes(*list_it);
+  if (victims) {
+    victims->splice(victims->end(), lru_list_, list_it);
+  } else {
+    lru_list_.erase(list_it);
   }
-  result += "\n";
-  result.shrink_to_fit();
-  return result;
 }
 
 // ----------------------------------------------------------------------------
@@ -535,27 +1296,576 @@ template <typename KeyType, typename ValueType,
           template <class> class LockingPolicy,
           template <class> class TimestampingPolicy,
           template <class> class HitCountingPolicy,
-          template <class> class LoggingPolicy>
-inline LruMapStats
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+typename LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ItemListIter
 LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
-  TimestampingPolicy, HitCountingPolicy, LoggingPolicy>::
-  lru_map_stats() const {
-  return lru_stats_;
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  OldestEvictablePrivate(const int64_t num_newest) {
+  int64_t num_left = SizePrivate() - num_newest;
+  if (num_left <= 0) {
+    return lru_list_.end();
+  }
+  // A pinned entry is in use, so it is treated as recently used rather than
+  // stepped over by every eviction. Each one is examined at most once.
+  const ItemListIter first_candidate =
+    std::next(lru_list_.begin(), num_newest);
+  for (; num_left > 0; --num_left) {
+    const ItemListIter list_it = std::prev(lru_list_.end());
+    if (PinningPolicy<KeyValueEntry>::IsEvictable(&*list_it)) {
+      return list_it;
+    }
+    lru_list_.splice(first_candidate, lru_list_, list_it);
+  }
+  return lru_list_.end();
 }
 
 // ----------------------------------------------------------------------------
 
-std::string LruMapStats::ToString() const {
-  std::ostringstream oss;
-  oss << "num_insert = " << num_insert;
-  oss << ", num_overflow = " << num_overflow;
-  oss << ", num_find = " << num_find;
-  oss << ", num_find_ok = " << num_find_ok;
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  EvictPrivate(const ItemListIter list_it, ItemList *const victims) {
+  LoggingPolicy<KeyValueEntry>::LogOverflow(*list_it);
+  SecondTierType::DemoteToSecondTier(list_it->key, list_it->value,
+                                     &lru_stats_);
+  IndexingPolicy<KeyValueEntry>::EraseEntry(&lru_key_map_, list_it);
+  UnlinkPrivate(list_it, victims);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  PinEntry(const ItemListIter list_it) {
+  LockingPolicy<ThisType> lock{this};
+  PinningPolicy<KeyValueEntry>::Pin(&*list_it);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  UnpinEntry(const ItemListIter list_it) {
+  LockingPolicy<ThisType> lock{this};
+  if (PinningPolicy<KeyValueEntry>::Unpin(&*list_it) &&
+      PinningPolicy<KeyValueEntry>::IsRetired(&*list_it)) {
+    payload_bytes_ -= PayloadBytes(*list_it);
+    retired_list_.erase(list_it);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+bool
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  Valid() const {
+  LockingPolicy<ThisType> lock{this};
+  return TimestampingPolicy<KeyValueEntry>::Valid(lru_list_);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+template <typename Visitor>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ForEachInLruOrder(Visitor visitor, const int64_t chunk_size) const {
+  ForEachPrivate(false /* from_most_recent */,
+                 std::numeric_limits<int64_t>::max(), visitor, chunk_size);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+template <typename Visitor>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ForEachMostRecent(const int64_t n, Visitor visitor,
+                    const int64_t chunk_size) const {
+  ForEachPrivate(true /* from_most_recent */, n, visitor, chunk_size);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+template <typename Visitor>
+void
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ForEachPrivate(const bool from_most_recent, const int64_t n,
+                 Visitor visitor, const int64_t chunk_size) const {
+  CHECK_GE(chunk_size, 1);
+
+  typedef typename ItemList::const_iterator ItemListConstIter;
+
+  // Key of the last visited entry, from where the next chunk resumes.
+  std::unique_ptr<KeyType> resume_key;
+  int64_t remaining = n;
+
+  while (remaining > 0) {
+    LockingPolicy<ThisType> lock{this};
+
+    ItemListConstIter list_it;
+    if (!resume_key) {
+      remaining = std::min<int64_t>(remaining, SizePrivate());
+      if (remaining == 0) {
+        return;
+      }
+      list_it = from_most_recent ? lru_list_.cbegin()
+                                 : std::prev(lru_list_.cend());
+    } else {
+      const auto map_it = lru_key_map_.find(*resume_key);
+      if (map_it == lru_key_map_.end()) {
+        return;
+      }
+      list_it = map_it->second;
+      if (from_most_recent) {
+        if (++list_it == lru_list_.cend()) {
+          return;
+        }
+      } else {
+        if (list_it == lru_list_.cbegin()) {
+          return;
+        }
+        --list_it;
+      }
+    }
+
+    for (int64_t visited = 0; visited < chunk_size; ++visited) {
+      visitor(list_it->key, list_it->value);
+      if (--remaining == 0) {
+        return;
+      }
+      if (from_most_recent) {
+        if (++list_it == lru_list_.cend()) {
+          return;
+        }
+      } else {
+        if (list_it == lru_list_.cbegin()) {
+          return;
+        }
+        --list_it;
+      }
+    }
+
+    // The entry at 'list_it' is not visited yet, so the next chunk resumes
+    // right after the entry before it.
+    resume_key.reset(new KeyType(from_most_recent ? std::prev(list_it)->key
+                                                  : std::next(list_it)->key));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+int64_t
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  EvictN(const int64_t n) {
+  // Declared before the lock, so that the victims are destroyed after the
+  // lock is released.
+  ItemList victims;
+
+  LockingPolicy<ThisType> lock{this};
+
+  int64_t num_evicted = 0;
+  while (num_evicted < n) {
+    const ItemListIter oldest = OldestEvictablePrivate(0);
+    if (oldest == lru_list_.end()) {
+      break;
+    }
+    EvictPrivate(oldest, &victims);
+    num_evicted += 1;
+  }
+  lru_stats_.num_evict += num_evicted;
+  return num_evicted;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+template <typename Predicate>
+int64_t
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  EvictColdest(Predicate predicate) {
+  // Declared before the lock, so that the victims are destroyed after the
+  // lock is released.
+  ItemList victims;
+
+  LockingPolicy<ThisType> lock{this};
+
+  int64_t num_evicted = 0;
+  ItemListIter list_it = lru_list_.end();
+  while (list_it != lru_list_.begin()) {
+    --list_it;
+    // Entries that may not be evicted are stepped over.
+    if (!PinningPolicy<KeyValueEntry>::IsEvictable(&*list_it)) {
+      continue;
+    }
+    if (!predicate(list_it->key, list_it->value)) {
+      break;
+    }
+    const ItemListIter victim_it = list_it;
+    ++list_it;
+    EvictPrivate(victim_it, &victims);
+    num_evicted += 1;
+  }
+  lru_stats_.num_evict += num_evicted;
+  return num_evicted;
+}
+
+// ----------------------------------------------------------------------------
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+std::string
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  ToString() const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  std::string result;
+  // Heuristic reserve, the excess is trimmed before returning.
+  result.reserve(lru_list_.size() * 32);
+  result += "key; value| atime; mtime\n";
+  for (const KeyValueEntry& kv_entry : lru_list_) {
+    result += kv_entry.ToString();
+  }
+  result += "\n";
+  result.shrink_to_fit();
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+inline LruMapStats
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  lru_map_stats() const {
+  return lru_stats_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+LruMapMemoryUsage
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  MemoryUsage() const {
+  // The same layout as KeyValueEntry, without the policies.
+  struct BareEntry {
+    KeyType key;
+    ValueType value;
+  };
+
+  // A std::list node is the element preceded by two links.
+  const int64_t entry_block_bytes =
+    LruMapAllocationBytes(sizeof(KeyValueEntry) + 2 * sizeof(void *));
+  const int64_t policy_bytes_per_entry =
+    sizeof(KeyValueEntry) - sizeof(BareEntry);
+
+  LockingPolicy<ThisType> lock{this};
+
+  LruMapMemoryUsage usage;
+  usage.num_entries = lru_list_.size() + retired_list_.size();
+  usage.entry_bytes =
+    usage.num_entries * (entry_block_bytes - policy_bytes_per_entry);
+  usage.policy_bytes = usage.num_entries * policy_bytes_per_entry;
+  usage.index_bytes =
+    IndexingPolicy<KeyValueEntry>::NodeBytes(lru_key_map_, key_payload_bytes_);
+  usage.bucket_bytes = IndexingPolicy<KeyValueEntry>::BucketBytes(lru_key_map_);
+  usage.payload_bytes = payload_bytes_;
+  usage.object_bytes = sizeof *this;
+  return usage;
+}
+
+// ----------------------------------------------------------------------------
+
+std::string LruMapStats::ToString() const {
+  std::ostringstream oss;
+  oss << "num_insert = " << num_insert;
+  oss << ", num_overflow = " << num_overflow;
+  oss << ", num_find = " << num_find;
+  oss << ", num_find_ok = " << num_find_ok;
   oss << ", num_erase = " << num_erase;
   oss << ", num_clear = " << num_clear;
+  oss << ", num_evict = " << num_evict;
+  oss << ", num_tier_write = " << num_tier_write;
+  oss << ", num_tier_find = " << num_tier_find;
+  oss << ", num_tier_find_ok = " << num_tier_find_ok;
+  oss << ", tier_write_bytes = " << tier_write_bytes;
+  oss << ", tier_read_bytes = " << tier_read_bytes;
+  oss << ", num_tier_error = " << num_tier_error;
+  oss << ", num_tier_drop = " << num_tier_drop;
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy,
+          template <class> class TimestampingPolicy,
+          template <class> class HitCountingPolicy,
+          template <class> class LoggingPolicy,
+          template <class> class PinningPolicy,
+          template <class> class IndexingPolicy,
+          template <class> class HotKeyTrackingPolicy,
+          template <class> class SecondTierPolicy>
+std::vector<HotKey<KeyType>>
+LruMap<KeyType, ValueType, LockingStoragePolicy, LockingPolicy,
+  TimestampingPolicy, HitCountingPolicy, LoggingPolicy, PinningPolicy,
+  IndexingPolicy, HotKeyTrackingPolicy, SecondTierPolicy>::
+  HotKeys(const int64_t n) const {
+  LockingPolicy<ThisType> lock{this};
+  return HotKeyTrackingPolicy<KeyType>::TopHotKeys(n);
+}
+
+// ----------------------------------------------------------------------------
+
+inline int64_t LruMapMemoryUsage::TotalBytes() const {
+  return entry_bytes + policy_bytes + index_bytes + bucket_bytes +
+         payload_bytes + object_bytes;
+}
+
+// ----------------------------------------------------------------------------
+
+inline double LruMapMemoryUsage::BytesPerEntry() const {
+  if (num_entries == 0) {
+    return 0;
+  }
+  return static_cast<double>(TotalBytes() - object_bytes) / num_entries;
+}
+
+// ----------------------------------------------------------------------------
+
+inline std::string LruMapMemoryUsage::ToString() const {
+  std::ostringstream oss;
+  oss << "num_entries = " << num_entries;
+  oss << ", entry_bytes = " << entry_bytes;
+  oss << ", policy_bytes = " << policy_bytes;
+  oss << ", index_bytes = " << index_bytes;
+  oss << ", bucket_bytes = " << bucket_bytes;
+  oss << ", payload_bytes = " << payload_bytes;
+  oss << ", object_bytes = " << object_bytes;
+  oss << ", total_bytes = " << TotalBytes();
+  oss << ", bytes_per_entry = " << BytesPerEntry();
   return oss.str();
 }
 
+// ----------------------------------------------------------------------------
+
+inline LruMapReclaimer *LruMapReclaimer::Instance() {
+  // Destroyed at exit, after destroying the garbage queued until then.
+  static LruMapReclaimer reclaimer;
+  return &reclaimer;
+}
+
+// ----------------------------------------------------------------------------
+
+inline LruMapReclaimer::LruMapReclaimer() :
+  thread_{&LruMapReclaimer::Run, this} {
+}
+
+// ----------------------------------------------------------------------------
+
+inline LruMapReclaimer::~LruMapReclaimer() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stop_ = true;
+  }
+  queued_cv_.notify_one();
+  thread_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class T>
+void LruMapReclaimer::Dispose(T&& garbage) {
+  std::unique_ptr<Garbage> item{
+    new GarbageT<typename std::decay<T>::type>{std::forward<T>(garbage)}};
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    queue_.push_back(std::move(item));
+    num_queued_ += 1;
+  }
+  queued_cv_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+inline void LruMapReclaimer::Drain() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  const int64_t num_queued = num_queued_;
+  reclaimed_cv_.wait(lock, [this, num_queued] {
+    return num_reclaimed_ >= num_queued;
+  });
+}
+
+// ----------------------------------------------------------------------------
+
+inline int64_t LruMapReclaimer::num_reclaimed() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return num_reclaimed_;
+}
+
+// ----------------------------------------------------------------------------
+
+inline void LruMapReclaimer::Run() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (true) {
+    queued_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    std::unique_ptr<Garbage> item = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    item.reset();
+    lock.lock();
+    num_reclaimed_ += 1;
+    reclaimed_cv_.notify_all();
+  }
+}
+
 // ----------------------------------------------------------------------------
 //                            LockingStoragePolicy
 // ----------------------------------------------------------------------------
@@ -606,7 +1916,8 @@ struct TimestampNone {
 
   // If timestamps are not maintained then there is no way to check validity,
   // so, as a benefit of doubt, the structure is considered valid.
-  static bool Valid(const std::list<T>& lru_list) {
+  template <class Entries>
+  static bool Valid(const Entries&) {
     return true;
   }
 
@@ -631,11 +1942,12 @@ struct TimestampAll {
     kv_entry->modify_time_usecs = MicrosecondsSinceEpoch();
   }
 
-  // Return 'true' iff the entries in the list are chronologically ordered from
-  // newer to older.
-  static bool Valid(const std::list<T>& lru_list) {
+  // Return 'true' iff the entries, iterated from the most recent to the least
+  // recent, are chronologically ordered from newer to older.
+  template <class Entries>
+  static bool Valid(const Entries& lru_entries) {
     int64_t prev_usecs = std::numeric_limits<int64_t>::max();
-    for (const T& kv_entry : lru_list) {
+    for (const T& kv_entry : lru_entries) {
       // Find the newer (i.e. larger) one between access time and modify time.
       const int64_t current_recent_usecs =
         std::max<int64_t>(kv_entry.access_time_usecs,
@@ -745,6 +2057,1235 @@ struct LogEventAll {
   }
 };
 
+// ----------------------------------------------------------------------------
+//                            PinningPolicy
+// ----------------------------------------------------------------------------
+
+template <class T>
+struct PinNone {
+  static constexpr bool kEnabled = false;
+  static bool IsPinned(const T *) { return false; }
+  static bool IsEvictable(const T *) { return true; }
+  static bool IsRetired(const T *) { return false; }
+  static void Pin(T *) {}
+  static bool Unpin(T *) { return false; }
+  static void Retire(T *) {}
+  std::string ToString() const { return std::string{}; };
+};
+
+// ----------------------------------------------------------------------------
+
+// Common part of the pinning policies that count the ValueHandles per entry.
+template <class T>
+struct PinCounted {
+  static constexpr bool kEnabled = true;
+  static bool IsPinned(const T *kv_entry) { return kv_entry->pin_count > 0; }
+  static bool IsRetired(const T *kv_entry) { return kv_entry->retired; }
+  static void Pin(T *kv_entry) { kv_entry->pin_count += 1; }
+
+  // Return true iff the last pin was released.
+  static bool Unpin(T *kv_entry) {
+    DCHECK_GT(kv_entry->pin_count, 0);
+    kv_entry->pin_count -= 1;
+    return kv_entry->pin_count == 0;
+  }
+
+  static void Retire(T *kv_entry) { kv_entry->retired = true; }
+
+  std::string ToString() const {
+    std::ostringstream oss;
+    oss << "| pin_count = " << pin_count;
+    return oss.str();
+  }
+
+  // Number of ValueHandles referring to this entry.
+  int32_t pin_count{0};
+
+  // Whether this entry was removed from the map while pinned.
+  bool retired{false};
+};
+
+// ----------------------------------------------------------------------------
+
+// Pinned entries are evicted as usual, but they stay alive, and their values
+// stay valid, until the last ValueHandle is released.
+template <class T>
+struct PinKeepAlive : public PinCounted<T> {
+  static bool IsEvictable(const T *) { return true; }
+};
+
+// ----------------------------------------------------------------------------
+
+// Pinned entries are skipped by eviction, so they stay in the map while
+// pinned; the map may then temporarily hold more than 'capacity' entries.
+// A pinned entry that eviction reaches is moved behind the most recent
+// entries, as in use, so it is not stepped over again and again.
+template <class T>
+struct PinResident : public PinCounted<T> {
+  static bool IsEvictable(const T *kv_entry) {
+    return !PinCounted<T>::IsPinned(kv_entry);
+  }
+};
+
+// ----------------------------------------------------------------------------
+//                            IndexingPolicy
+// ----------------------------------------------------------------------------
+
+// An IndexingPolicy supplies the hash table type, 'Map', that maps a key to
+// the list iterator of its entry. Map must offer the subset of the
+// std::unordered_map interface that LruMap uses. As a base class of the
+// entries, the policy may also keep per-entry data for the table.
+
+template <class T>
+struct IndexStdUnorderedMap {
+  template <class KeyT, class ListIterT>
+  using Map = std::unordered_map<KeyT, ListIterT>;
+
+  // Erase the mapping of the entry at 'list_it' from 'map'.
+  template <class MapT, class ListIterT>
+  static void EraseEntry(MapT *map, ListIterT list_it) {
+    map->erase(list_it->key);
+  }
+
+  // Return the bytes of the nodes of 'map', each holding a copy of its key,
+  // whose heap memory adds up to 'key_payload_bytes'.
+  template <class MapT>
+  static int64_t NodeBytes(const MapT& map, int64_t key_payload_bytes) {
+    // A node is a link and the value, followed by the hash code if the
+    // implementation caches it.
+#if defined(__GLIBCXX__)
+    const bool hash_cached =
+      std::__cache_default<typename MapT::key_type,
+                           typename MapT::hasher>::value;
+#else
+    const bool hash_cached = true;
+#endif
+    const size_t node_bytes = sizeof(void *) +
+                              sizeof(typename MapT::value_type) +
+                              (hash_cached ? sizeof(size_t) : 0);
+    return map.size() * LruMapAllocationBytes(node_bytes) + key_payload_bytes;
+  }
+
+  // Return the bytes of the bucket array of 'map'.
+  template <class MapT>
+  static int64_t BucketBytes(const MapT& map) {
+    // A map with a single bucket uses a bucket within the map object.
+    if (map.bucket_count() <= 1) {
+      return 0;
+    }
+    return LruMapAllocationBytes(map.bucket_count() * sizeof(void *));
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+// An index from keys to list iterators, for IndexSwissTable.
+//
+// The table is an array of slots, each holding just a list iterator, and a
+// parallel array of one byte control words. A control word is either
+// kEmpty, kDeleted, or, for a full slot, the low 7 bits of the key hash. The
+// slots are probed in groups of 16, and the control words of a group are
+// matched against the hash tag in one step using SSE2, or with a scalar loop
+// where SSE2 is not available. Only the matching slots are dereferenced to
+// compare keys, so most misses touch a single cache line.
+//
+// The key of a slot is found through its list iterator, whose entry must
+// have the members 'key' and 'index_hash'. The maximum load factor is 7/8.
+template <typename KeyType, typename ListIterType,
+          typename Hash = std::hash<KeyType>>
+class LruSwissIndex {
+ public:
+  // The slot mirrors the value_type of std::unordered_map, whose iterators
+  // LruMap dereferences through '->second'.
+  struct Slot {
+    ListIterType second;
+  };
+
+  typedef Slot *iterator;
+  typedef const Slot *const_iterator;
+
+  LruSwissIndex() = default;
+  LruSwissIndex(const LruSwissIndex&) = delete;
+  LruSwissIndex& operator=(const LruSwissIndex&) = delete;
+  LruSwissIndex(LruSwissIndex&& other) { swap(other); }
+
+  iterator find(const KeyType& key) {
+    return const_cast<iterator>(FindSlot(key));
+  }
+  const_iterator find(const KeyType& key) const { return FindSlot(key); }
+
+  iterator end() { return nullptr; }
+  const_iterator end() const { return nullptr; }
+
+  // Insert the mapping 'kv', unless the key is already mapped. The mixed key
+  // hash is stored in the entry of the list iterator.
+  std::pair<iterator, bool> insert(const std::pair<KeyType,
+                                                   ListIterType>& kv);
+
+  // Erase the mapping at 'it'.
+  void erase(iterator it);
+
+  // Erase the mapping whose list iterator is 'list_it', without hashing.
+  void erase_entry(ListIterType list_it);
+
+  size_t size() const { return size_; }
+  size_t bucket_count() const { return capacity_; }
+
+  // Erase all mappings, the memory is kept.
+  void clear();
+
+  // Make room for 'count' mappings. If 'count' is 0 and the table is empty
+  // then its memory is released.
+  void reserve(size_t count);
+
+  // Exchange the contents with 'other', in constant time.
+  void swap(LruSwissIndex& other) {
+    ctrl_.swap(other.ctrl_);
+    slots_.swap(other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(num_deleted_, other.num_deleted_);
+  }
+
+ private:
+  static constexpr size_t kGroupWidth = 16;
+  static constexpr uint8_t kEmpty = 0x80;
+  static constexpr uint8_t kDeleted = 0xFE;
+
+  static size_t HashOf(const KeyType& key) {
+    // std::hash is the identity for integers on common implementations, so
+    // the bits are mixed before they are split into the group and the tag.
+    // Both come from the low bits, so a multiply alone, whose low bits only
+    // depend on the low bits of the key, is not enough: keys that share
+    // their trailing zero bits, e.g. i << 32 or aligned pointers, would all
+    // land in one group with one tag. The finalizer of MurmurHash3 makes
+    // every bit depend on every bit of the key.
+    uint64_t hash = static_cast<uint64_t>(Hash()(key));
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return static_cast<size_t>(hash);
+  }
+  static size_t GroupOf(size_t hash) { return hash >> 7; }
+  static uint8_t TagOf(size_t hash) { return hash & 0x7F; }
+
+  // Return the bit mask of the control words in 'group' that equal 'ctrl'.
+  static uint32_t Match(const uint8_t *group, uint8_t ctrl);
+
+  // Return the bit mask of the control words in 'group' that are kEmpty or
+  // kDeleted, i.e. have the high bit set.
+  static uint32_t MatchFree(const uint8_t *group);
+
+  const Slot *FindSlot(const KeyType& key) const;
+
+  // Return the position of the first free slot along the probe sequence of
+  // 'hash'. There must be one.
+  size_t FindFree(size_t hash) const;
+
+  // Move all mappings into a table with 'capacity' slots.
+  void Rehash(size_t capacity);
+
+  std::unique_ptr<uint8_t[]> ctrl_;
+  std::unique_ptr<Slot[]> slots_;
+  size_t capacity_{0};     // # of slots, a power of 2 and at least 16.
+  size_t size_{0};         // # of full slots.
+  size_t num_deleted_{0};  // # of kDeleted slots.
+};
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+constexpr size_t LruSwissIndex<KeyType, ListIterType, Hash>::kGroupWidth;
+
+template <typename KeyType, typename ListIterType, typename Hash>
+constexpr uint8_t LruSwissIndex<KeyType, ListIterType, Hash>::kEmpty;
+
+template <typename KeyType, typename ListIterType, typename Hash>
+constexpr uint8_t LruSwissIndex<KeyType, ListIterType, Hash>::kDeleted;
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+inline uint32_t
+LruSwissIndex<KeyType, ListIterType, Hash>::Match(const uint8_t *group,
+                                                   const uint8_t ctrl) {
+#if defined(__SSE2__)
+  const __m128i ctrls =
+    _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+  return static_cast<uint32_t>(_mm_movemask_epi8(
+    _mm_cmpeq_epi8(ctrls, _mm_set1_epi8(static_cast<char>(ctrl)))));
+#else
+  uint32_t mask = 0;
+  for (size_t idx = 0; idx != kGroupWidth; ++idx) {
+    mask |= static_cast<uint32_t>(group[idx] == ctrl) << idx;
+  }
+  return mask;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+inline uint32_t
+LruSwissIndex<KeyType, ListIterType, Hash>::MatchFree(const uint8_t *group) {
+#if defined(__SSE2__)
+  return static_cast<uint32_t>(_mm_movemask_epi8(
+    _mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+#else
+  uint32_t mask = 0;
+  for (size_t idx = 0; idx != kGroupWidth; ++idx) {
+    mask |= static_cast<uint32_t>(group[idx] >> 7) << idx;
+  }
+  return mask;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+const typename LruSwissIndex<KeyType, ListIterType, Hash>::Slot *
+LruSwissIndex<KeyType, ListIterType, Hash>::FindSlot(
+  const KeyType& key) const {
+  if (size_ == 0) {
+    return nullptr;
+  }
+  const size_t hash = HashOf(key);
+  const uint8_t tag = TagOf(hash);
+  const size_t group_mask = capacity_ / kGroupWidth - 1;
+  size_t group = GroupOf(hash) & group_mask;
+  // Triangular probing visits every group when their number is a power of 2.
+  for (size_t probe = 1; ; ++probe) {
+    const uint8_t *ctrl = &ctrl_[group * kGroupWidth];
+    for (uint32_t matches = Match(ctrl, tag); matches != 0;
+         matches &= matches - 1) {
+      const Slot *slot = &slots_[group * kGroupWidth +
+                                 __builtin_ctz(matches)];
+      if (slot->second->key == key) {
+        return slot;
+      }
+    }
+    // The probe sequence of a key never passes a group with an empty slot.
+    if (Match(ctrl, kEmpty) != 0) {
+      return nullptr;
+    }
+    group = (group + probe) & group_mask;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+size_t
+LruSwissIndex<KeyType, ListIterType, Hash>::FindFree(const size_t hash) const {
+  const size_t group_mask = capacity_ / kGroupWidth - 1;
+  size_t group = GroupOf(hash) & group_mask;
+  for (size_t probe = 1; ; ++probe) {
+    const uint32_t free = MatchFree(&ctrl_[group * kGroupWidth]);
+    if (free != 0) {
+      return group * kGroupWidth + __builtin_ctz(free);
+    }
+    group = (group + probe) & group_mask;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+std::pair<typename LruSwissIndex<KeyType, ListIterType, Hash>::iterator, bool>
+LruSwissIndex<KeyType, ListIterType, Hash>::insert(
+  const std::pair<KeyType, ListIterType>& kv) {
+  const iterator existing = find(kv.first);
+  if (existing) {
+    return {existing, false};
+  }
+
+  // Grow when the load factor, counting the deleted slots, would exceed
+  // 7/8. If most of the load is deleted slots then the table is rebuilt at
+  // the same capacity instead.
+  if ((size_ + num_deleted_ + 1) * 8 > capacity_ * 7) {
+    const bool mostly_deleted = capacity_ > 0 && num_deleted_ > size_;
+    Rehash(capacity_ == 0 ? kGroupWidth
+                          : (mostly_deleted ? capacity_ : 2 * capacity_));
+  }
+
+  const size_t hash = HashOf(kv.first);
+  const size_t pos = FindFree(hash);
+  if (ctrl_[pos] == kDeleted) {
+    num_deleted_ -= 1;
+  }
+  ctrl_[pos] = TagOf(hash);
+  slots_[pos].second = kv.second;
+  kv.second->index_hash = hash;
+  size_ += 1;
+  return {&slots_[pos], true};
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+void
+LruSwissIndex<KeyType, ListIterType, Hash>::erase(const iterator it) {
+  const size_t pos = it - slots_.get();
+  DCHECK_LT(pos, capacity_);
+  DCHECK_LT(ctrl_[pos], kEmpty);
+  // A group that still has an empty slot was never full, so no probe
+  // sequence continues past it and the slot can become empty. Otherwise it
+  // becomes a tombstone, to keep the probe sequences through it intact.
+  const uint8_t *group = &ctrl_[pos / kGroupWidth * kGroupWidth];
+  if (Match(group, kEmpty) != 0) {
+    ctrl_[pos] = kEmpty;
+  } else {
+    ctrl_[pos] = kDeleted;
+    num_deleted_ += 1;
+  }
+  size_ -= 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+void
+LruSwissIndex<KeyType, ListIterType, Hash>::erase_entry(
+  const ListIterType list_it) {
+  const size_t hash = list_it->index_hash;
+  const uint8_t tag = TagOf(hash);
+  const size_t group_mask = capacity_ / kGroupWidth - 1;
+  size_t group = GroupOf(hash) & group_mask;
+  for (size_t probe = 1; ; ++probe) {
+    const uint8_t *ctrl = &ctrl_[group * kGroupWidth];
+    for (uint32_t matches = Match(ctrl, tag); matches != 0;
+         matches &= matches - 1) {
+      Slot *slot = &slots_[group * kGroupWidth + __builtin_ctz(matches)];
+      if (slot->second == list_it) {
+        erase(slot);
+        return;
+      }
+    }
+    CHECK_EQ(Match(ctrl, kEmpty), 0u) << "Entry is not in the index";
+    group = (group + probe) & group_mask;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+void
+LruSwissIndex<KeyType, ListIterType, Hash>::clear() {
+  if (capacity_ > 0) {
+    std::memset(ctrl_.get(), kEmpty, capacity_);
+  }
+  size_ = 0;
+  num_deleted_ = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+void
+LruSwissIndex<KeyType, ListIterType, Hash>::reserve(const size_t count) {
+  if (count == 0) {
+    if (size_ == 0) {
+      ctrl_.reset();
+      slots_.reset();
+      capacity_ = 0;
+      num_deleted_ = 0;
+    }
+    return;
+  }
+  size_t capacity = std::max(capacity_, kGroupWidth);
+  while (count * 8 > capacity * 7) {
+    capacity *= 2;
+  }
+  if (capacity != capacity_) {
+    Rehash(capacity);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ListIterType, typename Hash>
+void
+LruSwissIndex<KeyType, ListIterType, Hash>::Rehash(const size_t capacity) {
+  std::unique_ptr<uint8_t[]> old_ctrl{std::move(ctrl_)};
+  std::unique_ptr<Slot[]> old_slots{std::move(slots_)};
+  const size_t old_capacity = capacity_;
+
+  ctrl_.reset(new uint8_t[capacity]);
+  std::memset(ctrl_.get(), kEmpty, capacity);
+  slots_.reset(new Slot[capacity]);
+  capacity_ = capacity;
+  num_deleted_ = 0;
+
+  // The stored hashes are reused, keys are not rehashed.
+  for (size_t pos = 0; pos != old_capacity; ++pos) {
+    if (old_ctrl[pos] < kEmpty) {
+      const size_t new_pos = FindFree(old_slots[pos].second->index_hash);
+      ctrl_[new_pos] = old_ctrl[pos];
+      slots_[new_pos] = old_slots[pos];
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+// Open addressing hash table in the style of the Swiss tables, see
+// LruSwissIndex above. The full hash of each key is kept in its entry, so
+// eviction and growth never rehash keys.
+template <class T>
+struct IndexSwissTable {
+  template <class KeyT, class ListIterT>
+  using Map = LruSwissIndex<KeyT, ListIterT>;
+
+  // Erase the mapping of the entry at 'list_it' from 'map'.
+  template <class MapT, class ListIterT>
+  static void EraseEntry(MapT *map, ListIterT list_it) {
+    map->erase_entry(list_it);
+  }
+
+  // There are no nodes, and the keys are not copied.
+  template <class MapT>
+  static int64_t NodeBytes(const MapT&, int64_t) { return 0; }
+
+  // Return the bytes of the slots and of the control words of 'map'.
+  template <class MapT>
+  static int64_t BucketBytes(const MapT& map) {
+    if (map.bucket_count() == 0) {
+      return 0;
+    }
+    return LruMapAllocationBytes(map.bucket_count()) +
+           LruMapAllocationBytes(map.bucket_count() *
+                                 sizeof(typename MapT::Slot));
+  }
+
+  // The mixed hash of the key, maintained by LruSwissIndex.
+  size_t index_hash{0};
+};
+
+// ----------------------------------------------------------------------------
+//                            HotKeyTrackingPolicy
+// ----------------------------------------------------------------------------
+
+// A HotKeyTrackingPolicy is a base class of LruMap, instantiated with the
+// KeyType, so it may keep state. LruMap calls TrackHotKey() for every event,
+// under its lock, and TopHotKeys() for HotKeys().
+
+template <class KeyT>
+struct HotKeyNone {
+ protected:
+  void TrackHotKey(const KeyT&, HotKeyEvent) {}
+  std::vector<HotKey<KeyT>> TopHotKeys(int64_t) const {
+    return std::vector<HotKey<KeyT>>{};
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+// Estimate the most frequent keys over a sliding window, in constant memory,
+// using the Space-Saving algorithm of Metwally, Agrawal and El Abbadi.
+//
+// Each of 'kNumCounters' counters monitors a key. An event for a monitored
+// key increments its counter. An event for any other key takes over the
+// counter with the smallest count, c, and sets it to c + 1 with an error of
+// c. Any key occurring more than 1/kNumCounters of the time is guaranteed
+// to be monitored. The counters are kept in a binary min-heap, so an event
+// costs O(log kNumCounters).
+//
+// The window is approximated by two summaries: the current one, which
+// receives the events, and the previous one. After every 'kWindowSize'
+// events, the current summary becomes the previous one and a new current
+// one is started. TopHotKeys() reports the sum of both, i.e. it covers the
+// last kWindowSize to 2 * kWindowSize events.
+template <class KeyT, int kNumCounters, int64_t kWindowSize>
+class HotKeySpaceSavingT {
+ protected:
+  static_assert(kNumCounters >= 1, "kNumCounters must be positive");
+  static_assert(kWindowSize >= 1, "kWindowSize must be positive");
+
+  void TrackHotKey(const KeyT& key, HotKeyEvent event);
+  std::vector<HotKey<KeyT>> TopHotKeys(int64_t n) const;
+
+ private:
+  class Summary {
+   public:
+    Summary() { key_to_index_.reserve(kNumCounters); }
+
+    void Add(const KeyT& key, HotKeyEvent event);
+
+    void Clear() {
+      counters_.clear();
+      key_to_index_.clear();
+    }
+
+    const std::vector<HotKey<KeyT>>& counters() const { return counters_; }
+
+   private:
+    // Restore the heap order below 'index' after its count increased.
+    void SiftDown(size_t index);
+
+    // Min-heap on count.
+    std::vector<HotKey<KeyT>> counters_;
+
+    // Position of each monitored key in 'counters_'.
+    std::unordered_map<KeyT, size_t> key_to_index_;
+  };
+
+  Summary summaries_[2];
+  int current_{0};
+  int64_t num_window_events_{0};
+};
+
+// ----------------------------------------------------------------------------
+
+template <class KeyT, int kNumCounters, int64_t kWindowSize>
+void
+HotKeySpaceSavingT<KeyT, kNumCounters, kWindowSize>::TrackHotKey(
+  const KeyT& key, const HotKeyEvent event) {
+  if (num_window_events_ == kWindowSize) {
+    current_ = 1 - current_;
+    summaries_[current_].Clear();
+    num_window_events_ = 0;
+  }
+  summaries_[current_].Add(key, event);
+  num_window_events_ += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyT, int kNumCounters, int64_t kWindowSize>
+std::vector<HotKey<KeyT>>
+HotKeySpaceSavingT<KeyT, kNumCounters, kWindowSize>::TopHotKeys(
+  const int64_t n) const {
+  // Merge the two summaries. A key missing from one of them may have had
+  // up to that summary's smallest count, which is added to its error.
+  std::unordered_map<KeyT, HotKey<KeyT>> merged;
+  for (const Summary& summary : summaries_) {
+    for (const HotKey<KeyT>& counter : summary.counters()) {
+      const auto result = merged.insert({counter.key, counter});
+      if (!result.second) {
+        HotKey<KeyT>& hot_key = result.first->second;
+        hot_key.count += counter.count;
+        hot_key.error += counter.error;
+        hot_key.num_miss += counter.num_miss;
+        hot_key.num_insert += counter.num_insert;
+      }
+    }
+  }
+  for (const Summary& summary : summaries_) {
+    if (static_cast<int>(summary.counters().size()) < kNumCounters) {
+      continue;
+    }
+    const int64_t min_count = summary.counters().front().count;
+    for (auto& kv : merged) {
+      bool monitored = false;
+      for (const HotKey<KeyT>& counter : summary.counters()) {
+        if (counter.key == kv.first) {
+          monitored = true;
+          break;
+        }
+      }
+      if (!monitored) {
+        kv.second.error += min_count;
+      }
+    }
+  }
+
+  std::vector<HotKey<KeyT>> hot_keys;
+  hot_keys.reserve(merged.size());
+  for (const auto& kv : merged) {
+    hot_keys.push_back(kv.second);
+  }
+  std::sort(hot_keys.begin(), hot_keys.end(),
+            [](const HotKey<KeyT>& lhs, const HotKey<KeyT>& rhs) {
+              return lhs.count > rhs.count;
+            });
+  if (static_cast<int64_t>(hot_keys.size()) > n) {
+    hot_keys.erase(hot_keys.begin() + std::max<int64_t>(n, 0),
+                   hot_keys.end());
+  }
+  return hot_keys;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyT, int kNumCounters, int64_t kWindowSize>
+void
+HotKeySpaceSavingT<KeyT, kNumCounters, kWindowSize>::Summary::Add(
+  const KeyT& key, const HotKeyEvent event) {
+  size_t index;
+  const auto map_it = key_to_index_.find(key);
+  if (map_it != key_to_index_.end()) {
+    index = map_it->second;
+    counters_[index].count += 1;
+  } else if (static_cast<int>(counters_.size()) < kNumCounters) {
+    // A free counter; appending a count of 1 keeps the heap order, as the
+    // counts are all at least 1.
+    index = counters_.size();
+    counters_.push_back(HotKey<KeyT>{key, 1, 0, 0, 0});
+    key_to_index_.insert({key, index});
+  } else {
+    // Take over the counter with the smallest count.
+    index = 0;
+    HotKey<KeyT>& counter = counters_[index];
+    key_to_index_.erase(counter.key);
+    key_to_index_.insert({key, index});
+    counter.key = key;
+    counter.error = counter.count;
+    counter.count += 1;
+    counter.num_miss = 0;
+    counter.num_insert = 0;
+  }
+
+  if (event == HotKeyEvent::kFindMiss) {
+    counters_[index].num_miss += 1;
+  } else if (event == HotKeyEvent::kInsert) {
+    counters_[index].num_insert += 1;
+  }
+  SiftDown(index);
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyT, int kNumCounters, int64_t kWindowSize>
+void
+HotKeySpaceSavingT<KeyT, kNumCounters, kWindowSize>::Summary::SiftDown(
+  size_t index) {
+  const size_t size = counters_.size();
+  while (true) {
+    const size_t left = 2 * index + 1;
+    const size_t right = left + 1;
+    size_t smallest = index;
+    if (left < size && counters_[left].count < counters_[smallest].count) {
+      smallest = left;
+    }
+    if (right < size && counters_[right].count < counters_[smallest].count) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    std::swap(counters_[index], counters_[smallest]);
+    key_to_index_[counters_[index].key] = index;
+    key_to_index_[counters_[smallest].key] = smallest;
+    index = smallest;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+// Space-Saving with 64 counters over windows of 64K events.
+template <class KeyT>
+struct HotKeySpaceSaving : public HotKeySpaceSavingT<KeyT, 64, 65536> {
+};
+
+// ----------------------------------------------------------------------------
+//                              SecondTierPolicy
+// ----------------------------------------------------------------------------
+
+// A SecondTierPolicy is a base class of LruMap, instantiated with
+// std::pair<KeyType, ValueType>. Under the lock of the map, LruMap calls
+// DemoteToSecondTier() for every entry it evicts, FindInSecondTier() on a
+// Find() or Lookup() that misses in memory, EraseFromSecondTier() on
+// Insert() and Erase(), as any copy is then stale, and ClearSecondTier() on
+// Clear(). FindInSecondTier() promotes a found entry back into the map by
+// calling 'insert_fn' with its value.
+
+template <class KeyValuePair>
+struct SecondTierNone {
+ protected:
+  typedef typename KeyValuePair::first_type KeyT;
+  typedef typename KeyValuePair::second_type ValueT;
+
+  void DemoteToSecondTier(const KeyT&, const ValueT&, LruMapStats *) {}
+
+  template <class InsertFn>
+  bool FindInSecondTier(const KeyT&, LruMapStats *, InsertFn) {
+    return false;
+  }
+
+  void EraseFromSecondTier(const KeyT&) {}
+
+  void ClearSecondTier() {}
+};
+
+// ----------------------------------------------------------------------------
+
+// Keep evicted entries in a log structured local file.
+//
+// The file is divided into segments that are filled one after the other,
+// in a ring. Evicted entries are appended as records, a header with the
+// key and value sizes followed by their LruMapSerializer bytes, to a batch
+// buffer, which a writer thread writes to the file with pwrite() once it
+// holds 'batch_bytes', or when the segment is full. An in memory index maps
+// each key to the segment, offset and length of its latest record. Reads
+// are served from the buffers not yet written, or else with pread().
+//
+// Before a segment is filled again, its entries are dropped from the index,
+// using a list of the keys written to it, so the oldest entries are the
+// first to go (FIFO).
+//
+// The batches waiting for the writer thread are bounded by
+// 'max_pending_bytes'. While the disk falls behind and they hold more,
+// evicted entries are dropped instead of demoted, and counted in
+// LruMapStats::num_tier_drop, so a slow disk costs hits but not memory.
+//
+// Like the other SecondTierPolicy calls, FindInSecondTier() runs under the
+// lock of the map, so a miss whose record is in the file holds the lock
+// for a pread(), and the promotion. On a map shared by many threads, the
+// tier is best kept on storage with low read latency.
+//
+// The tier is inactive until OpenSecondTier() is called, which must happen
+// before the map is used. The file is unlinked as soon as it is opened, as
+// the index lives in memory only. ValueT must be default constructible.
+//
+// The tier is only a cache, so I/O errors are not fatal. A record that
+// cannot be read, or is corrupt, is dropped and the lookup is a miss. After
+// a failed write the tier turns itself off: its index and buffers are
+// dropped and later evictions are discarded. Both are counted in
+// LruMapStats::num_tier_error.
+template <class KeyValuePair>
+class SecondTierFile {
+ public:
+  typedef typename KeyValuePair::first_type KeyT;
+  typedef typename KeyValuePair::second_type ValueT;
+
+  SecondTierFile() = default;
+  ~SecondTierFile();
+
+  SecondTierFile(const SecondTierFile&) = delete;
+  SecondTierFile& operator=(const SecondTierFile&) = delete;
+
+  // Store evicted entries in a new file at 'path' of at most
+  // 'capacity_bytes', in segments of 'segment_bytes'. Records larger than a
+  // segment are not stored. Return false, leaving the tier inactive, if the
+  // file cannot be created.
+  bool OpenSecondTier(const std::string& path, int64_t capacity_bytes,
+                      int64_t segment_bytes = 4 << 20,
+                      int64_t batch_bytes = 64 << 10,
+                      int64_t max_pending_bytes = 16 << 20);
+
+  // Return the number of entries in the second tier.
+  int64_t SecondTierSize() const { return index_.size(); }
+
+ protected:
+  void DemoteToSecondTier(const KeyT& key, const ValueT& value,
+                          LruMapStats *stats);
+
+  template <class InsertFn>
+  bool FindInSecondTier(const KeyT& key, LruMapStats *stats,
+                        InsertFn insert_fn);
+
+  void EraseFromSecondTier(const KeyT& key) {
+    index_.erase(key);
+  }
+
+  void ClearSecondTier();
+
+ private:
+  // The header of a record.
+  struct RecordHeader {
+    uint32_t key_bytes;
+    uint32_t value_bytes;
+  };
+
+  // The location of a record in the file.
+  struct Location {
+    uint32_t segment;
+    uint32_t offset;  // Within the segment.
+    uint32_t bytes;
+  };
+
+  // Bytes to be written at 'offset' of the file.
+  struct Batch {
+    int64_t offset;
+    std::string data;
+  };
+
+  // Return true iff the tier is open and has not been turned off. Turn it
+  // off, counting the error in 'stats', if the writer thread failed.
+  bool Active(LruMapStats *stats);
+
+  // Hand 'buffer_' to the writer thread.
+  void FlushBuffer();
+
+  // Start filling the next segment, after dropping its current entries.
+  void AdvanceSegment();
+
+  // Copy the 'bytes' at 'offset' of the file to 'out'. Return the number
+  // of bytes read from the file itself, or -1 if the read failed or hit
+  // the end of the file.
+  int64_t Read(int64_t offset, uint32_t bytes, std::string *out);
+
+  // The body of the writer thread.
+  void WriteBatches();
+
+  // The file, or -1 if not opened.
+  int fd_{-1};
+
+  // Whether the tier was turned off after a failed write.
+  bool disabled_{false};
+
+  int64_t segment_bytes_{0};
+  int64_t batch_bytes_{0};
+  int64_t max_pending_bytes_{0};
+
+  // The segment being filled, and the bytes used in it.
+  uint32_t segment_{0};
+  int64_t segment_used_{0};
+
+  // The keys written to each segment, some of them may have been written
+  // again, or erased, since.
+  std::vector<std::vector<KeyT>> segment_keys_;
+
+  // The location of the latest record of every key in the tier.
+  std::unordered_map<KeyT, Location> index_;
+
+  // The records not yet handed to the writer thread, to be written at
+  // 'buffer_offset_' of the file.
+  std::string buffer_;
+  int64_t buffer_offset_{0};
+
+  // The batches handed to the writer thread. The front one is removed after
+  // it is written. If writing it fails, the writer thread sets
+  // 'write_failed_' and stops, leaving the batch readable until the tier is
+  // turned off.
+  std::mutex io_mutex_;
+  std::condition_variable io_cv_;
+  std::deque<std::shared_ptr<Batch>> pending_;
+  std::atomic<int64_t> pending_bytes_{0};  // In 'pending_'.
+  std::atomic<bool> write_failed_{false};
+  bool stop_{false};
+  std::thread writer_;
+};
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+SecondTierFile<KeyValuePair>::~SecondTierFile() {
+  if (fd_ < 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock{io_mutex_};
+    stop_ = true;
+  }
+  io_cv_.notify_one();
+  writer_.join();
+  close(fd_);
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+bool
+SecondTierFile<KeyValuePair>::OpenSecondTier(const std::string& path,
+                                             const int64_t capacity_bytes,
+                                             const int64_t segment_bytes,
+                                             const int64_t batch_bytes,
+                                             const int64_t max_pending_bytes) {
+  CHECK_LT(fd_, 0) << "Second tier already open";
+  CHECK_GT(segment_bytes, 0);
+  CHECK_LE(segment_bytes, std::numeric_limits<uint32_t>::max());
+  CHECK_GE(capacity_bytes / segment_bytes, 2)
+    << "The second tier needs at least two segments";
+  CHECK_GT(batch_bytes, 0);
+  CHECK_GT(max_pending_bytes, 0);
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd_ < 0) {
+    LOG(WARNING) << "Cannot open second tier " << path << ": "
+                 << strerror(errno);
+    return false;
+  }
+  unlink(path.c_str());
+
+  segment_bytes_ = segment_bytes;
+  batch_bytes_ = batch_bytes;
+  max_pending_bytes_ = max_pending_bytes;
+  segment_keys_.resize(capacity_bytes / segment_bytes);
+  segment_ = 0;
+  segment_used_ = 0;
+  buffer_offset_ = 0;
+  writer_ = std::thread{&SecondTierFile::WriteBatches, this};
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+bool
+SecondTierFile<KeyValuePair>::Active(LruMapStats *const stats) {
+  if (fd_ < 0 || disabled_) {
+    return false;
+  }
+  if (!write_failed_.load(std::memory_order_acquire)) {
+    return true;
+  }
+
+  LOG(WARNING) << "Second tier turned off after a failed write";
+  disabled_ = true;
+  stats->num_tier_error += 1;
+  ClearSecondTier();
+  std::string{}.swap(buffer_);
+  std::lock_guard<std::mutex> lock{io_mutex_};
+  pending_.clear();
+  pending_bytes_.store(0, std::memory_order_relaxed);
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+void
+SecondTierFile<KeyValuePair>::DemoteToSecondTier(const KeyT& key,
+                                                 const ValueT& value,
+                                                 LruMapStats *const stats) {
+  if (!Active(stats)) {
+    return;
+  }
+  if (pending_bytes_.load(std::memory_order_relaxed) >= max_pending_bytes_) {
+    // The writer thread is behind, drop the entry rather than queue more.
+    index_.erase(key);
+    stats->num_tier_drop += 1;
+    return;
+  }
+
+  // Serialize the record at the end of 'buffer_', then fill in its header.
+  const size_t start = buffer_.size();
+  buffer_.resize(start + sizeof(RecordHeader));
+  LruMapSerializer<KeyT>::Append(key, &buffer_);
+  const size_t value_start = buffer_.size();
+  LruMapSerializer<ValueT>::Append(value, &buffer_);
+  const RecordHeader header{
+    static_cast<uint32_t>(value_start - start - sizeof(RecordHeader)),
+    static_cast<uint32_t>(buffer_.size() - value_start)};
+  std::memcpy(&buffer_[start], &header, sizeof header);
+  const int64_t bytes = buffer_.size() - start;
+
+  if (bytes > segment_bytes_) {
+    buffer_.resize(start);
+    index_.erase(key);
+    return;
+  }
+  if (segment_used_ + bytes > segment_bytes_) {
+    // Move the record to the start of the next segment.
+    std::string record = buffer_.substr(start);
+    buffer_.resize(start);
+    AdvanceSegment();
+    buffer_ = std::move(record);
+  }
+
+  index_[key] = Location{segment_, static_cast<uint32_t>(segment_used_),
+                         static_cast<uint32_t>(bytes)};
+  segment_keys_[segment_].push_back(key);
+  segment_used_ += bytes;
+  stats->num_tier_write += 1;
+  stats->tier_write_bytes += bytes;
+
+  if (static_cast<int64_t>(buffer_.size()) >= batch_bytes_) {
+    FlushBuffer();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+template <class InsertFn>
+bool
+SecondTierFile<KeyValuePair>::FindInSecondTier(const KeyT& key,
+                                               LruMapStats *const stats,
+                                               InsertFn insert_fn) {
+  if (!Active(stats)) {
+    return false;
+  }
+  stats->num_tier_find += 1;
+
+  const auto index_it = index_.find(key);
+  if (index_it == index_.end()) {
+    return false;
+  }
+  const Location location = index_it->second;
+  index_.erase(index_it);
+
+  std::string record;
+  const int64_t read_bytes = Read(
+    location.segment * segment_bytes_ + location.offset, location.bytes,
+    &record);
+  if (read_bytes < 0) {
+    stats->num_tier_error += 1;
+    return false;
+  }
+  stats->tier_read_bytes += read_bytes;
+
+  RecordHeader header{0, 0};
+  if (record.size() >= sizeof header) {
+    std::memcpy(&header, record.data(), sizeof header);
+  }
+  const char *const key_data = record.data() + sizeof header;
+  KeyT stored_key;
+  ValueT value;
+  if (sizeof header + static_cast<uint64_t>(header.key_bytes) +
+        header.value_bytes != record.size() ||
+      !LruMapSerializer<KeyT>::Parse(key_data, header.key_bytes,
+                                     &stored_key) ||
+      !(stored_key == key) ||
+      !LruMapSerializer<ValueT>::Parse(key_data + header.key_bytes,
+                                       header.value_bytes, &value)) {
+    LOG(WARNING) << "Corrupt second tier record for " << key;
+    stats->num_tier_error += 1;
+    return false;
+  }
+
+  stats->num_tier_find_ok += 1;
+  insert_fn(value);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+void
+SecondTierFile<KeyValuePair>::ClearSecondTier() {
+  index_.clear();
+  for (std::vector<KeyT>& keys : segment_keys_) {
+    keys.clear();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+void
+SecondTierFile<KeyValuePair>::FlushBuffer() {
+  if (buffer_.empty()) {
+    return;
+  }
+  std::shared_ptr<Batch> batch{new Batch{buffer_offset_, std::string{}}};
+  batch->data.swap(buffer_);
+  buffer_offset_ += batch->data.size();
+  {
+    std::lock_guard<std::mutex> lock{io_mutex_};
+    pending_bytes_.fetch_add(batch->data.size(), std::memory_order_relaxed);
+    pending_.push_back(std::move(batch));
+  }
+  io_cv_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+void
+SecondTierFile<KeyValuePair>::AdvanceSegment() {
+  FlushBuffer();
+  segment_ = (segment_ + 1) % segment_keys_.size();
+  segment_used_ = 0;
+  buffer_offset_ = segment_ * segment_bytes_;
+
+  // Drop the entries whose latest record is in the segment.
+  std::vector<KeyT>& keys = segment_keys_[segment_];
+  for (const KeyT& key : keys) {
+    const auto index_it = index_.find(key);
+    if (index_it != index_.end() && index_it->second.segment == segment_) {
+      index_.erase(index_it);
+    }
+  }
+  keys.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+int64_t
+SecondTierFile<KeyValuePair>::Read(const int64_t offset,
+                                   const uint32_t bytes,
+                                   std::string *const out) {
+  out->resize(bytes);
+
+  // A record is either in 'buffer_', in a pending batch, or in the file,
+  // as batches are removed from 'pending_' only after they are written.
+  // Once the ring wraps around, an older batch for the same offsets may
+  // still be pending, so the newest batch holding the record wins.
+  if (offset >= buffer_offset_ &&
+      offset + bytes <= buffer_offset_ + static_cast<int64_t>(buffer_.size())) {
+    std::memcpy(&(*out)[0], buffer_.data() + (offset - buffer_offset_),
+                bytes);
+    return 0;
+  }
+  {
+    std::lock_guard<std::mutex> lock{io_mutex_};
+    for (auto batch_it = pending_.rbegin(); batch_it != pending_.rend();
+         ++batch_it) {
+      const std::shared_ptr<Batch>& batch = *batch_it;
+      if (offset >= batch->offset &&
+          offset + bytes <=
+            batch->offset + static_cast<int64_t>(batch->data.size())) {
+        std::memcpy(&(*out)[0], batch->data.data() + (offset - batch->offset),
+                    bytes);
+        return 0;
+      }
+    }
+  }
+
+  int64_t done = 0;
+  while (done < bytes) {
+    const ssize_t rc = pread(fd_, &(*out)[done], bytes - done, offset + done);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc < 0) {
+      LOG(WARNING) << "Second tier read failed: " << strerror(errno);
+      return -1;
+    }
+    if (rc == 0) {
+      // The file ends short of the record.
+      return -1;
+    }
+    done += rc;
+  }
+  return bytes;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class KeyValuePair>
+void
+SecondTierFile<KeyValuePair>::WriteBatches() {
+  std::unique_lock<std::mutex> lock{io_mutex_};
+  while (true) {
+    io_cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+    if (pending_.empty() || write_failed_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    // The batch stays in 'pending_', readable, until it is written.
+    const std::shared_ptr<Batch> batch = pending_.front();
+    lock.unlock();
+    int64_t done = 0;
+    const int64_t size = batch->data.size();
+    while (done < size) {
+      const ssize_t rc = pwrite(fd_, batch->data.data() + done, size - done,
+                                batch->offset + done);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc <= 0) {
+        LOG(WARNING) << "Second tier write failed: "
+                     << (rc < 0 ? strerror(errno) : "no progress");
+        break;
+      }
+      done += rc;
+    }
+    lock.lock();
+    if (done < size) {
+      // Leave the rest to Active(), under the lock of the map.
+      write_failed_.store(true, std::memory_order_release);
+      return;
+    }
+    pending_.pop_front();
+    pending_bytes_.fetch_sub(size, std::memory_order_relaxed);
+  }
+}
+
 // ----------------------------------------------------------------------------
 
 #endif // _LRU_MAP_H_
@@ -0,0 +1,203 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides LruMapEvictor, which takes eviction off the Insert()
+ * path of an LruMap (see lru_map.h) by running it in a maintenance thread.
+ *
+ * When an Insert() overflows, it evicts the least recent entry under the
+ * lock of the map: it unlinks the entry, erases its key from the index and
+ * applies the LoggingPolicy and SecondTierPolicy. With large values, that
+ * shows up in the tail latency of Insert().
+ *
+ * LruMapEvictor uses two watermarks. It raises the overflow limit of the
+ * map to the high watermark, so Insert() lets the map grow up to that
+ * before it evicts anything itself. The maintenance thread wakes up every
+ * 'interval' and, while the size exceeds the low watermark, evicts the
+ * excess with EvictN(), in batches of 'batch_size' entries per lock
+ * acquisition, so other callers are never blocked for long. EvictN()
+ * destroys the evicted entries after releasing the lock.
+ *
+ * While the size stays at or below the low watermark, the thread doubles
+ * its sleep after every check, up to kMaxIdleBackoff times 'interval', so
+ * an idle map is not polled, and its lock taken, every 'interval'. The
+ * first check that finds work resets the sleep to 'interval'. The price is
+ * that after an idle period the thread may take up to kMaxIdleBackoff
+ * times 'interval' to notice new inserts.
+ *
+ * If the maintenance thread falls behind, Insert() evicts synchronously at
+ * the high watermark, so the size stays bounded.
+ *
+ * The map must be thread safe, i.e. instantiated with a LockingPolicy such
+ * as LockExclusiveStd, and must outlive the evictor. Destroying the evictor
+ * stops the thread and restores the overflow limit the map had before the
+ * evictor was constructed.
+ */
+
+#ifndef _LRU_MAP_EVICTOR_H_
+#define _LRU_MAP_EVICTOR_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "lru_map.h"
+
+// Counters of an LruMapEvictor.
+struct LruMapEvictorStats {
+  int64_t num_poll{0};   // # of times the thread checked the size.
+  int64_t num_run{0};    // # of times the thread found the map to be full.
+  int64_t num_evict{0};  // # of entries evicted by the thread.
+  std::string ToString() const;
+};
+
+template <class LruMapType>
+class LruMapEvictor {
+ public:
+  // Keep the size of 'lru_map' at most 'low_watermark' in the background,
+  // and let Insert() evict only above 'high_watermark'. The watermarks must
+  // satisfy low_watermark <= Capacity() <= high_watermark.
+  LruMapEvictor(LruMapType *lru_map, int64_t low_watermark,
+                int64_t high_watermark,
+                std::chrono::microseconds interval =
+                  std::chrono::microseconds{1000},
+                int64_t batch_size = 256);
+
+  ~LruMapEvictor();
+
+  LruMapEvictor(const LruMapEvictor&) = delete;
+  LruMapEvictor& operator=(const LruMapEvictor&) = delete;
+
+  // Return a copy of the statistics.
+  LruMapEvictorStats evictor_stats() const;
+
+ private:
+  // The longest sleep of an idle thread, in multiples of 'interval'.
+  static constexpr int kMaxIdleBackoff = 64;
+
+  // The body of the maintenance thread.
+  void Run();
+
+  LruMapType *const lru_map_;
+  const int64_t low_watermark_;
+  const std::chrono::microseconds interval_;
+  const int64_t batch_size_;
+
+  // The overflow limit of the map before construction, restored on
+  // destruction.
+  const int64_t saved_overflow_limit_;
+
+  std::atomic<int64_t> num_poll_{0};
+  std::atomic<int64_t> num_run_{0};
+  std::atomic<int64_t> num_evict_{0};
+
+  // Wakes the thread up early to stop it.
+  std::mutex mutex_;
+  std::condition_variable stop_cv_;
+  bool stop_{false};
+
+  std::thread thread_;
+};
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType>
+constexpr int LruMapEvictor<LruMapType>::kMaxIdleBackoff;
+
+// ----------------------------------------------------------------------------
+
+inline std::string LruMapEvictorStats::ToString() const {
+  std::ostringstream oss;
+  oss << "num_poll = " << num_poll;
+  oss << ", num_run = " << num_run;
+  oss << ", num_evict = " << num_evict;
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType>
+LruMapEvictor<LruMapType>::LruMapEvictor(
+  LruMapType *const lru_map, const int64_t low_watermark,
+  const int64_t high_watermark, const std::chrono::microseconds interval,
+  const int64_t batch_size) :
+  lru_map_{lru_map},
+  low_watermark_{low_watermark},
+  interval_{interval},
+  batch_size_{batch_size},
+  saved_overflow_limit_{lru_map->OverflowLimit()} {
+
+  CHECK_GE(low_watermark_, 0);
+  CHECK_LE(low_watermark_, lru_map_->Capacity());
+  CHECK_GE(high_watermark, lru_map_->Capacity());
+  CHECK_GE(batch_size_, 1);
+  lru_map_->SetOverflowLimit(high_watermark);
+  thread_ = std::thread{&LruMapEvictor::Run, this};
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType>
+LruMapEvictor<LruMapType>::~LruMapEvictor() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stop_ = true;
+  }
+  stop_cv_.notify_one();
+  thread_.join();
+  lru_map_->SetOverflowLimit(saved_overflow_limit_);
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType>
+LruMapEvictorStats
+LruMapEvictor<LruMapType>::evictor_stats() const {
+  LruMapEvictorStats stats;
+  stats.num_poll = num_poll_.load(std::memory_order_relaxed);
+  stats.num_run = num_run_.load(std::memory_order_relaxed);
+  stats.num_evict = num_evict_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType>
+void
+LruMapEvictor<LruMapType>::Run() {
+  std::chrono::microseconds sleep = interval_;
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (!stop_) {
+    lock.unlock();
+
+    num_poll_.fetch_add(1, std::memory_order_relaxed);
+    int64_t excess = lru_map_->Size() - low_watermark_;
+    if (excess > 0) {
+      num_run_.fetch_add(1, std::memory_order_relaxed);
+      sleep = interval_;
+    } else {
+      sleep = std::min(sleep * 2, interval_ * kMaxIdleBackoff);
+    }
+    while (excess > 0) {
+      const int64_t num_evicted =
+        lru_map_->EvictN(std::min(excess, batch_size_));
+      if (num_evicted == 0) {
+        // Only pinned entries are left.
+        break;
+      }
+      num_evict_.fetch_add(num_evicted, std::memory_order_relaxed);
+      excess = lru_map_->Size() - low_watermark_;
+    }
+
+    lock.lock();
+    stop_cv_.wait_for(lock, sleep, [this] { return stop_; });
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _LRU_MAP_EVICTOR_H_
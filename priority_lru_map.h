@@ -0,0 +1,589 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides PriorityLruMap, a variant of LruMap (see lru_map.h)
+ * whose entries belong to priority classes, each with its own usage list,
+ * and which can pin entries so that they are never evicted.
+ *
+ * LruMap treats all entries equally, so a burst of cheap to refetch bulk
+ * entries pushes out the expensive ones, say index or metadata blocks.
+ * In PriorityLruMap, Insert() takes a priority class, from 0, the lowest,
+ * to kNumClasses - 1, the highest. Every class has its own usage list and
+ * a capacity share, the fraction of the capacity its entries may occupy.
+ *
+ * When an insertion takes the map beyond its capacity, or a class beyond
+ * its share, an entry is evicted:
+ *
+ *  - If the class of the inserted entry is over its share, then its own
+ *    least recent entry is evicted. A class can never take more than its
+ *    share, whatever its priority.
+ *
+ *  - Otherwise, the least recent entry of the lowest priority class that
+ *    has one is evicted. That is, the lower priority pools are drained
+ *    first.
+ *
+ * With the default shares, all 1.0, eviction is strictly by priority.
+ *
+ * Pin() moves an entry out of its class into the pinned pool, whose entries
+ * are never evicted, but count against the capacity. Unpin() returns the
+ * entry to its class as the most recent one. If the pinned entries leave no
+ * room, the size exceeds the capacity until some are unpinned.
+ *
+ * The LockingStoragePolicy and LockingPolicy are the same as those of
+ * LruMap.
+ */
+
+#ifndef _PRIORITY_LRU_MAP_H_
+#define _PRIORITY_LRU_MAP_H_
+
+#include <algorithm>
+#include <array>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "lru_map.h"
+
+// Occupancy and counters of a priority class of a PriorityLruMap.
+struct PriorityLruMapClassStats {
+  int64_t size{0};         // # of entries in the class, excluding pinned.
+  int64_t capacity{0};     // # of entries the share of the class allows.
+  int64_t num_insert{0};   // # of insertions into the class.
+  int64_t num_find_ok{0};  // # of successful finds of entries of the class.
+  int64_t num_evict{0};    // # of entries of the class evicted.
+  std::string ToString() const;
+};
+
+template <typename KeyType, typename ValueType, int kNumClasses = 2,
+          template <class> class LockingStoragePolicy = LockStorageNone,
+          template <class> class LockingPolicy = LockNone>
+class PriorityLruMap : public LockingStoragePolicy<void> {
+ public:
+  static_assert(kNumClasses >= 1, "PriorityLruMap needs a class");
+
+  // Construct an object with specified 'capacity', and a share of 1.0 for
+  // every class.
+  explicit PriorityLruMap(int64_t capacity);
+
+  // Construct an object with specified 'capacity', where the entries of
+  // class 'c' may occupy up to 'capacity_shares[c]' of it.
+  PriorityLruMap(int64_t capacity,
+                 const std::array<double, kNumClasses>& capacity_shares);
+
+  PriorityLruMap(const PriorityLruMap&) = delete;
+  PriorityLruMap& operator=(const PriorityLruMap&) = delete;
+
+  // Insert or update an entry with key 'key' and value 'value' in class
+  // 'priority'.
+  //
+  // If an entry with 'key' already exists, then it is refreshed to be the
+  // most recent entry of 'priority', unless pinned, and the value of the
+  // entry would be the new 'value' supplied.
+  //
+  // If the number of entries exceeds the capacity, or those of 'priority'
+  // exceed its share, then an entry is thrown away, see above.
+  void Insert(const KeyType& key, const ValueType& value, int priority = 0);
+
+  // Find the entry, if exists, for the key 'key'. The returned pointer may
+  // become stale through other operations, the client is required to protect
+  // against that, for example by copying the object elsewhere.
+  const ValueType *Find(const KeyType& key);
+
+  // Return true iff an entry with 'key' exists, false otherwise.
+  bool Exists(const KeyType& key) const;
+
+  // Erase entry with key 'key', if exists, pinned or not.
+  void Erase(const KeyType& key);
+
+  // Pin the entry with key 'key', so that it is never evicted. Return false
+  // if there is no such entry.
+  bool Pin(const KeyType& key);
+
+  // Unpin the entry with key 'key'. Return false if there is no such
+  // pinned entry.
+  bool Unpin(const KeyType& key);
+
+  // Clear all entries in the map, pinned or not.
+  void Clear();
+
+  // Return the capacity, i.e. the maximum possible number of entries.
+  int64_t Capacity() const;
+
+  // Return the current number of entries, including the pinned ones.
+  int64_t Size() const;
+
+  // Return the current number of pinned entries.
+  int64_t NumPinned() const;
+
+  // Audit the lists and the index and return true iff they agree, false
+  // otherwise.
+  bool Valid() const;
+
+  // Return string representation of this object.
+  std::string ToString() const;
+
+  // Return a copy of the statistics.
+  LruMapStats lru_map_stats() const;
+
+  // Return a copy of the statistics of class 'priority'.
+  PriorityLruMapClassStats class_stats(int priority) const;
+
+ private:
+  typedef PriorityLruMap<KeyType, ValueType, kNumClasses,
+    LockingStoragePolicy, LockingPolicy> ThisType;
+
+  friend struct LockingPolicy<ThisType>;
+
+  struct KeyValueEntry {
+    KeyType key;
+    ValueType value;
+    int priority;
+    bool pinned;
+  };
+
+  typedef std::list<KeyValueEntry> ItemList;
+  typedef typename ItemList::iterator ItemListIter;
+  typedef std::unordered_map<KeyType, ItemListIter> ItemMap;
+  typedef typename ItemMap::iterator ItemMapIter;
+
+  // Return the list holding the entry 'kv_entry'.
+  ItemList& ListOf(const KeyValueEntry& kv_entry);
+
+  // Evict entries while the class 'priority' is over its share or the map
+  // is over its capacity, sparing the most recent entry of 'priority'.
+  void OverflowPrivate(int priority);
+
+  // Evict the least recent entry of class 'priority', which is not empty.
+  void EvictPrivate(int priority);
+
+  // The capacity, i.e. maximum number of elements at a time.
+  const int64_t capacity_{0};
+
+  // Cumulative lifetime stats, persist on Clear().
+  LruMapStats lru_stats_;
+
+  // The usage list and the stats of each class, the most recent entry at
+  // front.
+  std::array<ItemList, kNumClasses> class_lists_;
+  std::array<PriorityLruMapClassStats, kNumClasses> class_stats_;
+
+  // The pinned entries, in no particular order.
+  ItemList pinned_list_;
+
+  // Map element keys to element values, in whichever list.
+  ItemMap lru_key_map_;
+};
+
+// ----------------------------------------------------------------------------
+
+inline std::string PriorityLruMapClassStats::ToString() const {
+  std::ostringstream oss;
+  oss << "size = " << size;
+  oss << ", capacity = " << capacity;
+  oss << ", num_insert = " << num_insert;
+  oss << ", num_find_ok = " << num_find_ok;
+  oss << ", num_evict = " << num_evict;
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::PriorityLruMap(const int64_t capacity) :
+  PriorityLruMap{capacity, [] {
+    std::array<double, kNumClasses> capacity_shares;
+    capacity_shares.fill(1.0);
+    return capacity_shares;
+  }()} {
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::PriorityLruMap(
+  const int64_t capacity,
+  const std::array<double, kNumClasses>& capacity_shares) :
+  capacity_{capacity} {
+
+  CHECK_GE(capacity_, 1);
+  for (int priority = 0; priority != kNumClasses; ++priority) {
+    const double share = capacity_shares[priority];
+    CHECK(share > 0 && share <= 1) << "Bad share " << share << " of class "
+                                   << priority;
+    class_stats_[priority].capacity =
+      std::max<int64_t>(1, static_cast<int64_t>(share * capacity_));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+inline typename PriorityLruMap<KeyType, ValueType, kNumClasses,
+  LockingStoragePolicy, LockingPolicy>::ItemList&
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::ListOf(const KeyValueEntry& kv_entry) {
+  return kv_entry.pinned ? pinned_list_ : class_lists_[kv_entry.priority];
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Insert(const KeyType& key, const ValueType& value,
+                         const int priority) {
+  CHECK(priority >= 0 && priority < kNumClasses) << priority;
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_insert += 1;
+  class_stats_[priority].num_insert += 1;
+
+  ItemList& class_list = class_lists_[priority];
+  const ItemMapIter map_it = lru_key_map_.find(key);
+  if (map_it != lru_key_map_.end()) {
+    KeyValueEntry& kv_entry = *map_it->second;
+    kv_entry.value = value;
+    if (kv_entry.pinned) {
+      // It returns to 'priority' when unpinned.
+      kv_entry.priority = priority;
+      return;
+    }
+    class_stats_[kv_entry.priority].size -= 1;
+    class_list.splice(class_list.begin(), ListOf(kv_entry), map_it->second);
+    kv_entry.priority = priority;
+  } else {
+    class_list.push_front(KeyValueEntry{key, value, priority, false});
+    const std::pair<ItemMapIter, bool> result =
+      lru_key_map_.insert({key, class_list.begin()});
+    CHECK(result.second);
+  }
+  class_stats_[priority].size += 1;
+
+  OverflowPrivate(priority);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::OverflowPrivate(const int priority) {
+  // A class over its share evicts its own least recent entry, which is
+  // never the most recent one, as the share is at least one entry.
+  while (class_stats_[priority].size > class_stats_[priority].capacity) {
+    lru_stats_.num_overflow += 1;
+    EvictPrivate(priority);
+  }
+
+  // Drain the lower priority pools first. The most recent entry of
+  // 'priority' is not evicted, so with too many pinned entries the size
+  // stays above capacity.
+  int victim_priority = 0;
+  while (static_cast<int64_t>(lru_key_map_.size()) > capacity_) {
+    while (victim_priority != kNumClasses &&
+           class_stats_[victim_priority].size <=
+             (victim_priority == priority ? 1 : 0)) {
+      ++victim_priority;
+    }
+    if (victim_priority == kNumClasses) {
+      return;
+    }
+    lru_stats_.num_overflow += 1;
+    EvictPrivate(victim_priority);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::EvictPrivate(const int priority) {
+  ItemList& class_list = class_lists_[priority];
+  DCHECK(!class_list.empty());
+  lru_key_map_.erase(class_list.back().key);
+  class_list.pop_back();
+  class_stats_[priority].size -= 1;
+  class_stats_[priority].num_evict += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+const ValueType *
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Find(const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_find += 1;
+
+  const ItemMapIter map_it = lru_key_map_.find(key);
+  if (map_it == lru_key_map_.end()) {
+    return nullptr;
+  }
+
+  KeyValueEntry& kv_entry = *map_it->second;
+  lru_stats_.num_find_ok += 1;
+  class_stats_[kv_entry.priority].num_find_ok += 1;
+  if (!kv_entry.pinned) {
+    ItemList& class_list = class_lists_[kv_entry.priority];
+    class_list.splice(class_list.begin(), class_list, map_it->second);
+  }
+  return &kv_entry.value;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+bool
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Exists(const KeyType& key) const {
+  LockingPolicy<ThisType> lock{this};
+  return lru_key_map_.find(key) != lru_key_map_.end();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Erase(const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_erase += 1;
+
+  const ItemMapIter map_it = lru_key_map_.find(key);
+  if (map_it == lru_key_map_.end()) {
+    return;
+  }
+  const ItemListIter list_it = map_it->second;
+  if (!list_it->pinned) {
+    class_stats_[list_it->priority].size -= 1;
+  }
+  ListOf(*list_it).erase(list_it);
+  lru_key_map_.erase(map_it);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+bool
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Pin(const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  const ItemMapIter map_it = lru_key_map_.find(key);
+  if (map_it == lru_key_map_.end()) {
+    return false;
+  }
+  KeyValueEntry& kv_entry = *map_it->second;
+  if (!kv_entry.pinned) {
+    pinned_list_.splice(pinned_list_.begin(),
+                        class_lists_[kv_entry.priority], map_it->second);
+    class_stats_[kv_entry.priority].size -= 1;
+    kv_entry.pinned = true;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+bool
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Unpin(const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  const ItemMapIter map_it = lru_key_map_.find(key);
+  if (map_it == lru_key_map_.end() || !map_it->second->pinned) {
+    return false;
+  }
+  KeyValueEntry& kv_entry = *map_it->second;
+  const int priority = kv_entry.priority;
+  class_lists_[priority].splice(class_lists_[priority].begin(), pinned_list_,
+                                map_it->second);
+  class_stats_[priority].size += 1;
+  kv_entry.pinned = false;
+
+  OverflowPrivate(priority);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Clear() {
+
+  LockingPolicy<ThisType> lock{this};
+
+  for (int priority = 0; priority != kNumClasses; ++priority) {
+    class_lists_[priority].clear();
+    class_stats_[priority].size = 0;
+  }
+  pinned_list_.clear();
+  lru_key_map_.clear();
+  lru_stats_.num_clear += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+inline int64_t
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Capacity() const {
+  return capacity_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+int64_t
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Size() const {
+  LockingPolicy<ThisType> lock{this};
+  return lru_key_map_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+int64_t
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::NumPinned() const {
+  LockingPolicy<ThisType> lock{this};
+  return pinned_list_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+bool
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::Valid() const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  int64_t num_entries = 0;
+  auto valid_list = [this, &num_entries](const ItemList& list,
+                                         const bool pinned,
+                                         const int priority) {
+    for (auto list_it = list.begin(); list_it != list.end(); ++list_it) {
+      const auto map_it = lru_key_map_.find(list_it->key);
+      if (map_it == lru_key_map_.end() || &*map_it->second != &*list_it ||
+          list_it->pinned != pinned ||
+          (!pinned && list_it->priority != priority)) {
+        return false;
+      }
+      ++num_entries;
+    }
+    return true;
+  };
+  for (int priority = 0; priority != kNumClasses; ++priority) {
+    if (!valid_list(class_lists_[priority], false, priority) ||
+        static_cast<int64_t>(class_lists_[priority].size()) !=
+          class_stats_[priority].size) {
+      return false;
+    }
+  }
+  return valid_list(pinned_list_, true, 0) &&
+         num_entries == static_cast<int64_t>(lru_key_map_.size());
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+std::string
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::ToString() const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  std::ostringstream oss;
+  oss << "capacity = " << capacity_ << ", size = " << lru_key_map_.size()
+      << ", pinned = " << pinned_list_.size() << "\n";
+  for (int priority = kNumClasses - 1; priority >= 0; --priority) {
+    oss << "class " << priority << ": "
+        << class_stats_[priority].ToString() << "\n";
+    for (const KeyValueEntry& kv_entry : class_lists_[priority]) {
+      oss << kv_entry.key << "; " << kv_entry.value << "\n";
+    }
+  }
+  oss << "pinned:\n";
+  for (const KeyValueEntry& kv_entry : pinned_list_) {
+    oss << kv_entry.key << "; " << kv_entry.value << "\n";
+  }
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+LruMapStats
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::lru_map_stats() const {
+  LockingPolicy<ThisType> lock{this};
+  return lru_stats_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, int kNumClasses,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+PriorityLruMapClassStats
+PriorityLruMap<KeyType, ValueType, kNumClasses, LockingStoragePolicy,
+  LockingPolicy>::class_stats(const int priority) const {
+  CHECK(priority >= 0 && priority < kNumClasses) << priority;
+  LockingPolicy<ThisType> lock{this};
+  return class_stats_[priority];
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _PRIORITY_LRU_MAP_H_
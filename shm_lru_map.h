@@ -0,0 +1,803 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides ShmLruMap, a variant of LruMap (see lru_map.h) that
+ * lives in a shared memory segment, so that several processes on a host
+ * can share one cache, and can reattach to it after a restart.
+ *
+ * Running one LruMap per worker process multiplies both the memory and the
+ * misses to the backend by the number of workers. ShmLruMap keeps all of
+ * its state in a segment created with shm_open(), or in a memory mapped
+ * file, which every process maps at whatever address it gets. Therefore
+ * nothing in the segment is a pointer, every link is a slot index:
+ *
+ *  - A header: a magic number and a layout version, the geometry, the
+ *    lock, the list heads and the stats.
+ *
+ *  - An array of 'num_buckets' hash buckets, each the index of the first
+ *    slot of its chain.
+ *
+ *  - An array of 'capacity' slots, each holding a key, a value, the 'prev'
+ *    and 'next' links of the usage ordered list (most recent at head) and
+ *    the 'chain' link of its bucket. The free slots are threaded into a
+ *    free list through 'next'.
+ *
+ * Since the bytes of the keys and values are shared, KeyType and ValueType
+ * must be trivially copyable, e.g. integers or fixed size arrays and
+ * structs, and all processes must use the same types and the same Hash.
+ * Find() copies the value out; a pointer into the segment could be
+ * overwritten by another process at any time.
+ *
+ * Locking. All operations are serialized by a process shared, robust
+ * pthread mutex in the header. If a process dies while holding it, the
+ * next process to lock it cannot trust the half updated links, so it
+ * resets the map to empty, counts the event in num_recovery() and marks
+ * the mutex consistent. For a cache, losing the contents is preferable to
+ * serving garbage.
+ *
+ * Lifetime. The segment outlives the processes; destroying a ShmLruMap only
+ * unmaps it. Unlink() removes the segment, after which new objects create a
+ * new one.
+ *
+ * Creation. A process opening the segment holds an flock() on it until it
+ * has checked, or initialized, the header. The first one finds it empty and
+ * initializes it. If a process dies while initializing it, the lock is
+ * released with its descriptor, and the next process to take it finds the
+ * magic number unset and initializes the segment in its place.
+ */
+
+#ifndef _SHM_LRU_MAP_H_
+#define _SHM_LRU_MAP_H_
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "lru_map.h"
+
+// Where the segment of a ShmLruMap lives.
+enum class ShmLruMapBacking {
+  kPosixShm,  // A POSIX shared memory object, 'name' is like "/my_cache".
+  kFile,      // A regular file, 'name' is its path.
+};
+
+template <typename KeyType, typename ValueType,
+          typename Hash = std::hash<KeyType>>
+class ShmLruMap {
+ public:
+  static_assert(std::is_trivially_copyable<KeyType>::value,
+                "ShmLruMap KeyType must be trivially copyable");
+  static_assert(std::is_trivially_copyable<ValueType>::value,
+                "ShmLruMap ValueType must be trivially copyable");
+
+  // Attach to the segment 'name', creating it for 'capacity' entries if it
+  // does not exist. An existing segment must have the same capacity and
+  // layout, i.e. it must have been created with the same types.
+  ShmLruMap(const std::string& name, int64_t capacity,
+            ShmLruMapBacking backing = ShmLruMapBacking::kPosixShm);
+
+  // Detach from the segment, which is left intact for other processes.
+  ~ShmLruMap();
+
+  ShmLruMap(const ShmLruMap&) = delete;
+  ShmLruMap& operator=(const ShmLruMap&) = delete;
+
+  // Remove the segment 'name'. Processes still attached keep using it.
+  // Return true iff it existed.
+  static bool Unlink(const std::string& name,
+                     ShmLruMapBacking backing = ShmLruMapBacking::kPosixShm);
+
+  // Insert or update an entry with key 'key' and value 'value'.
+  //
+  // If an entry with 'key' already exists, then it is refreshed to be the most
+  // recent entry and the value of the entry would be the new 'value' supplied.
+  //
+  // If the number of entries had already reached the capacity, then the
+  // oldest entry is thrown away.
+  void Insert(const KeyType& key, const ValueType& value);
+
+  // Find the entry, if exists, for the key 'key'. If found then copy its
+  // value to 'value', make it the most recent entry and return true.
+  bool Find(const KeyType& key, ValueType *value);
+
+  // Return true iff an entry with 'key' exists, false otherwise.
+  bool Exists(const KeyType& key) const;
+
+  // Erase entry with key 'key', if exists.
+  void Erase(const KeyType& key);
+
+  // Clear all entries in the map.
+  void Clear();
+
+  // Return the capacity, i.e. the maximum possible number of entries.
+  int64_t Capacity() const;
+
+  // Return the current number of entries.
+  int64_t Size() const;
+
+  // Audit the links of the segment and return true iff they are consistent,
+  // false otherwise.
+  bool Valid() const;
+
+  // Return string representation of this object.
+  std::string ToString() const;
+
+  // Return a copy of the statistics, shared by all attached processes.
+  LruMapStats lru_map_stats() const;
+
+  // Return the number of times the map was reset because a process died
+  // while holding the lock.
+  int64_t num_recovery() const;
+
+  // Return true iff this object initialized the segment, normally as its
+  // creator.
+  bool created() const { return created_; }
+
+ private:
+  // "LRUSHMAP", identifies an initialized segment.
+  static constexpr uint64_t kMagic = 0x4c525553484d4150ull;
+
+  // Bump when the layout of the segment changes.
+  static constexpr uint32_t kVersion = 3;
+
+  // The link value meaning 'no slot'.
+  static constexpr int32_t kNil = -1;
+
+  // How long to wait for another process to check or initialize the
+  // segment.
+  static constexpr int64_t kAttachTimeoutMsecs = 10000;
+
+  // The counters kept in the segment. A fixed layout of its own, rather
+  // than LruMapStats, so that the segment does not change as LruMap gains
+  // counters. Only ever append to it, and bump kVersion.
+  struct SharedStats {
+    int64_t num_insert;
+    int64_t num_overflow;
+    int64_t num_find;
+    int64_t num_find_ok;
+    int64_t num_erase;
+    int64_t num_clear;
+  };
+  static_assert(sizeof(SharedStats) == 6 * sizeof(int64_t),
+                "SharedStats must have a fixed layout");
+
+  struct Header {
+    // Set last, with release semantics, by the process that initializes
+    // the segment.
+    std::atomic<uint64_t> magic;
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t key_bytes;
+    uint32_t value_bytes;
+    uint32_t slot_bytes;
+    int64_t capacity;
+    int64_t num_buckets;
+    int64_t segment_bytes;
+
+    pthread_mutex_t mutex;
+
+    // Protected by 'mutex'.
+    int32_t head;
+    int32_t tail;
+    int32_t free_head;
+    int64_t size;
+    int64_t num_recovery;
+    SharedStats stats;
+  };
+
+  // Slots are never constructed, their bytes are copied with memcpy().
+  struct Slot {
+    KeyType key;
+    ValueType value;
+    int32_t prev;
+    int32_t next;
+    int32_t chain;
+  };
+
+  // Holds the mutex of the segment for its lifetime.
+  class Lock {
+   public:
+    explicit Lock(const ShmLruMap *map);
+    ~Lock();
+
+   private:
+    const ShmLruMap *const map_;
+  };
+
+  // Return the number of buckets for 'capacity', a power of 2.
+  static int64_t NumBuckets(int64_t capacity);
+
+  // Return the size of a segment for 'capacity' entries.
+  static int64_t SegmentBytes(int64_t capacity);
+
+  // Return the offsets of the bucket and slot arrays in the segment.
+  static int64_t BucketsOffset();
+  static int64_t SlotsOffset(int64_t capacity);
+
+  // Take the flock() of 'fd_', waiting for up to kAttachTimeoutMsecs.
+  void LockSegment();
+
+  // Size the segment of 'fd_' for 'capacity', zero filled, map it and
+  // initialize it.
+  void InitSegment(int64_t capacity);
+
+  // If the segment of 'fd_' is initialized, map it, check that it matches
+  // this type and 'capacity' and return true. Return false otherwise.
+  bool AttachSegment(int64_t capacity);
+
+  // Empty the map, without applying the lock.
+  void ResetPrivate();
+
+  // Return the counters of the segment, without applying the lock.
+  LruMapStats LruMapStatsPrivate() const;
+
+  // Return the bucket of 'key'.
+  int64_t BucketOf(const KeyType& key) const;
+
+  // Return the slot of 'key' in 'bucket', or kNil.
+  int32_t FindPrivate(const KeyType& key, int64_t bucket) const;
+
+  // Remove the slot 'idx', which is in the map, and put it on the free list.
+  void RemovePrivate(int32_t idx);
+
+  // Unlink slot 'idx' from the usage list.
+  void UnlinkPrivate(int32_t idx);
+
+  // Link slot 'idx' at the head of the usage list.
+  void LinkFrontPrivate(int32_t idx);
+
+  Slot& SlotAt(int32_t idx) const { return slots_[idx]; }
+
+  // The name and backing of the segment.
+  const std::string name_;
+  const ShmLruMapBacking backing_;
+
+  // True iff this object created the segment.
+  bool created_{false};
+
+  // The file descriptor of the segment, open while attached.
+  int fd_{-1};
+
+  // The mapping of the segment in this process.
+  void *segment_{nullptr};
+  int64_t segment_bytes_{0};
+
+  // Views into 'segment_'.
+  Header *header_{nullptr};
+  int32_t *buckets_{nullptr};
+  Slot *slots_{nullptr};
+};
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+constexpr uint64_t ShmLruMap<KeyType, ValueType, Hash>::kMagic;
+
+template <typename KeyType, typename ValueType, typename Hash>
+constexpr uint32_t ShmLruMap<KeyType, ValueType, Hash>::kVersion;
+
+template <typename KeyType, typename ValueType, typename Hash>
+constexpr int32_t ShmLruMap<KeyType, ValueType, Hash>::kNil;
+
+template <typename KeyType, typename ValueType, typename Hash>
+constexpr int64_t ShmLruMap<KeyType, ValueType, Hash>::kAttachTimeoutMsecs;
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+ShmLruMap<KeyType, ValueType, Hash>::ShmLruMap(
+  const std::string& name, const int64_t capacity,
+  const ShmLruMapBacking backing) :
+  name_{name},
+  backing_{backing} {
+
+  CHECK_GE(capacity, 1);
+  CHECK_LT(capacity, int64_t{1} << 31);
+
+  // Whoever holds the lock first, with the segment not yet initialized,
+  // initializes it; normally its creator, else the process taking over
+  // from a creator that died.
+  const int flags = O_RDWR | O_CREAT;
+  const mode_t mode = 0600;
+  fd_ = backing_ == ShmLruMapBacking::kPosixShm ?
+    shm_open(name_.c_str(), flags, mode) :
+    open(name_.c_str(), flags, mode);
+  CHECK_GE(fd_, 0) << "Cannot open " << name_ << ": " << strerror(errno);
+  LockSegment();
+  if (!AttachSegment(capacity)) {
+    created_ = true;
+    InitSegment(capacity);
+  }
+  CHECK_EQ(flock(fd_, LOCK_UN), 0) << strerror(errno);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+ShmLruMap<KeyType, ValueType, Hash>::~ShmLruMap() {
+  CHECK_EQ(munmap(segment_, segment_bytes_), 0);
+  close(fd_);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+bool
+ShmLruMap<KeyType, ValueType, Hash>::Unlink(const std::string& name,
+                                            const ShmLruMapBacking backing) {
+  return (backing == ShmLruMapBacking::kPosixShm ?
+          shm_unlink(name.c_str()) : unlink(name.c_str())) == 0;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+int64_t
+ShmLruMap<KeyType, ValueType, Hash>::NumBuckets(const int64_t capacity) {
+  int64_t num_buckets = 16;
+  while (num_buckets < capacity) {
+    num_buckets *= 2;
+  }
+  return num_buckets;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline int64_t
+ShmLruMap<KeyType, ValueType, Hash>::BucketsOffset() {
+  return (sizeof(Header) + 63) / 64 * 64;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline int64_t
+ShmLruMap<KeyType, ValueType, Hash>::SlotsOffset(const int64_t capacity) {
+  const int64_t buckets_end =
+    BucketsOffset() + NumBuckets(capacity) * sizeof(int32_t);
+  return (buckets_end + 63) / 64 * 64;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline int64_t
+ShmLruMap<KeyType, ValueType, Hash>::SegmentBytes(const int64_t capacity) {
+  return SlotsOffset(capacity) + capacity * sizeof(Slot);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::LockSegment() {
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(kAttachTimeoutMsecs);
+  while (flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+    CHECK(errno == EWOULDBLOCK || errno == EINTR)
+      << "Cannot lock " << name_ << ": " << strerror(errno);
+    CHECK(std::chrono::steady_clock::now() < deadline)
+      << "Timed out waiting for another process to set up " << name_;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::InitSegment(const int64_t capacity) {
+  // Truncate first, so that what a dead creator left behind is zeroed.
+  segment_bytes_ = SegmentBytes(capacity);
+  CHECK_EQ(ftruncate(fd_, 0), 0)
+    << "Cannot size " << name_ << ": " << strerror(errno);
+  CHECK_EQ(ftruncate(fd_, segment_bytes_), 0)
+    << "Cannot size " << name_ << ": " << strerror(errno);
+  segment_ = mmap(nullptr, segment_bytes_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd_, 0);
+  CHECK(segment_ != MAP_FAILED) << "Cannot map " << name_ << ": "
+                                << strerror(errno);
+
+  header_ = static_cast<Header *>(segment_);
+  buckets_ = reinterpret_cast<int32_t *>(
+    static_cast<char *>(segment_) + BucketsOffset());
+  slots_ = reinterpret_cast<Slot *>(
+    static_cast<char *>(segment_) + SlotsOffset(capacity));
+
+  // The segment is zero filled, 'magic' reads 0 until it is published.
+  header_->version = kVersion;
+  header_->header_bytes = sizeof(Header);
+  header_->key_bytes = sizeof(KeyType);
+  header_->value_bytes = sizeof(ValueType);
+  header_->slot_bytes = sizeof(Slot);
+  header_->capacity = capacity;
+  header_->num_buckets = NumBuckets(capacity);
+  header_->segment_bytes = segment_bytes_;
+
+  pthread_mutexattr_t attr;
+  CHECK_EQ(pthread_mutexattr_init(&attr), 0);
+  CHECK_EQ(pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED), 0);
+  CHECK_EQ(pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST), 0);
+  CHECK_EQ(pthread_mutex_init(&header_->mutex, &attr), 0);
+  pthread_mutexattr_destroy(&attr);
+
+  header_->num_recovery = 0;
+  header_->stats = SharedStats{};
+  ResetPrivate();
+
+  header_->magic.store(kMagic, std::memory_order_release);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+bool
+ShmLruMap<KeyType, ValueType, Hash>::AttachSegment(const int64_t capacity) {
+  // A new segment is empty, one whose creator died may be sized but its
+  // magic number is unset.
+  struct stat st;
+  CHECK_EQ(fstat(fd_, &st), 0) << strerror(errno);
+  if (st.st_size < static_cast<off_t>(sizeof(Header))) {
+    return false;
+  }
+  segment_bytes_ = st.st_size;
+  segment_ = mmap(nullptr, segment_bytes_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd_, 0);
+  CHECK(segment_ != MAP_FAILED) << "Cannot map " << name_ << ": "
+                                << strerror(errno);
+  header_ = static_cast<Header *>(segment_);
+  if (header_->magic.load(std::memory_order_acquire) != kMagic) {
+    LOG(WARNING) << "Taking over " << name_
+                 << ", left uninitialized by its creator";
+    CHECK_EQ(munmap(segment_, segment_bytes_), 0);
+    segment_ = nullptr;
+    header_ = nullptr;
+    return false;
+  }
+
+  // The version and header size are checked before the sizes that depend
+  // on them.
+  CHECK_EQ(header_->version, kVersion) << name_;
+  CHECK_EQ(header_->header_bytes, sizeof(Header)) << name_;
+  CHECK_EQ(segment_bytes_, SegmentBytes(capacity))
+    << name_ << " was created for a different capacity or types";
+  buckets_ = reinterpret_cast<int32_t *>(
+    static_cast<char *>(segment_) + BucketsOffset());
+  slots_ = reinterpret_cast<Slot *>(
+    static_cast<char *>(segment_) + SlotsOffset(capacity));
+
+  CHECK_EQ(header_->key_bytes, sizeof(KeyType)) << name_;
+  CHECK_EQ(header_->value_bytes, sizeof(ValueType)) << name_;
+  CHECK_EQ(header_->slot_bytes, sizeof(Slot)) << name_;
+  CHECK_EQ(header_->capacity, capacity) << name_;
+  CHECK_EQ(header_->segment_bytes, segment_bytes_) << name_;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+ShmLruMap<KeyType, ValueType, Hash>::Lock::Lock(const ShmLruMap *const map) :
+  map_{map} {
+  Header *const header = map_->header_;
+  const int rc = pthread_mutex_lock(&header->mutex);
+  if (rc == EOWNERDEAD) {
+    // The previous owner died in the middle of an update.
+    LOG(WARNING) << "Owner of " << map_->name_ << " died, resetting it";
+    const_cast<ShmLruMap *>(map_)->ResetPrivate();
+    header->num_recovery += 1;
+    CHECK_EQ(pthread_mutex_consistent(&header->mutex), 0);
+  } else {
+    CHECK_EQ(rc, 0) << "Cannot lock " << map_->name_ << ": " << strerror(rc);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+ShmLruMap<KeyType, ValueType, Hash>::Lock::~Lock() {
+  pthread_mutex_unlock(&map_->header_->mutex);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::ResetPrivate() {
+  for (int64_t bucket = 0; bucket != header_->num_buckets; ++bucket) {
+    buckets_[bucket] = kNil;
+  }
+  const int32_t capacity = static_cast<int32_t>(header_->capacity);
+  for (int32_t idx = 0; idx != capacity; ++idx) {
+    SlotAt(idx).next = idx + 1 == capacity ? kNil : idx + 1;
+  }
+  header_->free_head = 0;
+  header_->head = kNil;
+  header_->tail = kNil;
+  header_->size = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline int64_t
+ShmLruMap<KeyType, ValueType, Hash>::BucketOf(const KeyType& key) const {
+  // std::hash of integers is the identity, spread the bits.
+  const uint64_t hash =
+    static_cast<uint64_t>(Hash()(key)) * 0x9E3779B97F4A7C15ull;
+  return static_cast<int64_t>(hash >> 32) & (header_->num_buckets - 1);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline int32_t
+ShmLruMap<KeyType, ValueType, Hash>::FindPrivate(const KeyType& key,
+                                                 const int64_t bucket) const {
+  for (int32_t idx = buckets_[bucket]; idx != kNil; idx = SlotAt(idx).chain) {
+    if (SlotAt(idx).key == key) {
+      return idx;
+    }
+  }
+  return kNil;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::RemovePrivate(const int32_t idx) {
+  int32_t *link = &buckets_[BucketOf(SlotAt(idx).key)];
+  while (*link != idx) {
+    DCHECK_NE(*link, kNil);
+    link = &SlotAt(*link).chain;
+  }
+  *link = SlotAt(idx).chain;
+
+  UnlinkPrivate(idx);
+  SlotAt(idx).next = header_->free_head;
+  header_->free_head = idx;
+  header_->size -= 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline void
+ShmLruMap<KeyType, ValueType, Hash>::UnlinkPrivate(const int32_t idx) {
+  Slot& slot = SlotAt(idx);
+  if (slot.prev == kNil) {
+    header_->head = slot.next;
+  } else {
+    SlotAt(slot.prev).next = slot.next;
+  }
+  if (slot.next == kNil) {
+    header_->tail = slot.prev;
+  } else {
+    SlotAt(slot.next).prev = slot.prev;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline void
+ShmLruMap<KeyType, ValueType, Hash>::LinkFrontPrivate(const int32_t idx) {
+  Slot& slot = SlotAt(idx);
+  slot.prev = kNil;
+  slot.next = header_->head;
+  if (header_->head == kNil) {
+    header_->tail = idx;
+  } else {
+    SlotAt(header_->head).prev = idx;
+  }
+  header_->head = idx;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::Insert(const KeyType& key,
+                                            const ValueType& value) {
+  Lock lock{this};
+  header_->stats.num_insert += 1;
+
+  const int64_t bucket = BucketOf(key);
+  int32_t idx = FindPrivate(key, bucket);
+  if (idx != kNil) {
+    std::memcpy(&SlotAt(idx).value, &value, sizeof(ValueType));
+    UnlinkPrivate(idx);
+    LinkFrontPrivate(idx);
+    return;
+  }
+
+  if (header_->free_head == kNil) {
+    header_->stats.num_overflow += 1;
+    RemovePrivate(header_->tail);
+  }
+  idx = header_->free_head;
+  Slot& slot = SlotAt(idx);
+  header_->free_head = slot.next;
+  std::memcpy(&slot.key, &key, sizeof(KeyType));
+  std::memcpy(&slot.value, &value, sizeof(ValueType));
+  slot.chain = buckets_[bucket];
+  buckets_[bucket] = idx;
+  LinkFrontPrivate(idx);
+  header_->size += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+bool
+ShmLruMap<KeyType, ValueType, Hash>::Find(const KeyType& key,
+                                          ValueType *const value) {
+  Lock lock{this};
+  header_->stats.num_find += 1;
+
+  const int32_t idx = FindPrivate(key, BucketOf(key));
+  if (idx == kNil) {
+    return false;
+  }
+  header_->stats.num_find_ok += 1;
+  std::memcpy(value, &SlotAt(idx).value, sizeof(ValueType));
+  if (header_->head != idx) {
+    UnlinkPrivate(idx);
+    LinkFrontPrivate(idx);
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+bool
+ShmLruMap<KeyType, ValueType, Hash>::Exists(const KeyType& key) const {
+  Lock lock{this};
+  return FindPrivate(key, BucketOf(key)) != kNil;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::Erase(const KeyType& key) {
+  Lock lock{this};
+  header_->stats.num_erase += 1;
+
+  const int32_t idx = FindPrivate(key, BucketOf(key));
+  if (idx != kNil) {
+    RemovePrivate(idx);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+void
+ShmLruMap<KeyType, ValueType, Hash>::Clear() {
+  Lock lock{this};
+  header_->stats.num_clear += 1;
+  ResetPrivate();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+inline int64_t
+ShmLruMap<KeyType, ValueType, Hash>::Capacity() const {
+  return header_->capacity;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+int64_t
+ShmLruMap<KeyType, ValueType, Hash>::Size() const {
+  Lock lock{this};
+  return header_->size;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+bool
+ShmLruMap<KeyType, ValueType, Hash>::Valid() const {
+  Lock lock{this};
+
+  // Walk the usage list, every entry must be reachable from its bucket.
+  int64_t num_entries = 0;
+  int32_t prev = kNil;
+  for (int32_t idx = header_->head; idx != kNil; idx = SlotAt(idx).next) {
+    if (idx < 0 || idx >= header_->capacity ||
+        num_entries == header_->capacity || SlotAt(idx).prev != prev ||
+        FindPrivate(SlotAt(idx).key, BucketOf(SlotAt(idx).key)) != idx) {
+      return false;
+    }
+    prev = idx;
+    ++num_entries;
+  }
+  if (prev != header_->tail || num_entries != header_->size) {
+    return false;
+  }
+
+  int64_t num_free = 0;
+  for (int32_t idx = header_->free_head; idx != kNil;
+       idx = SlotAt(idx).next) {
+    if (idx < 0 || idx >= header_->capacity ||
+        num_free == header_->capacity) {
+      return false;
+    }
+    ++num_free;
+  }
+  return num_entries + num_free == header_->capacity;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+std::string
+ShmLruMap<KeyType, ValueType, Hash>::ToString() const {
+  Lock lock{this};
+  std::ostringstream oss;
+  oss << "name = " << name_;
+  oss << ", capacity = " << header_->capacity;
+  oss << ", size = " << header_->size;
+  oss << ", segment_bytes = " << header_->segment_bytes;
+  oss << ", num_recovery = " << header_->num_recovery;
+  oss << ", " << LruMapStatsPrivate().ToString();
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+LruMapStats
+ShmLruMap<KeyType, ValueType, Hash>::lru_map_stats() const {
+  Lock lock{this};
+  return LruMapStatsPrivate();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+LruMapStats
+ShmLruMap<KeyType, ValueType, Hash>::LruMapStatsPrivate() const {
+  LruMapStats stats;
+  stats.num_insert = header_->stats.num_insert;
+  stats.num_overflow = header_->stats.num_overflow;
+  stats.num_find = header_->stats.num_find;
+  stats.num_find_ok = header_->stats.num_find_ok;
+  stats.num_erase = header_->stats.num_erase;
+  stats.num_clear = header_->stats.num_clear;
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename KeyType, typename ValueType, typename Hash>
+int64_t
+ShmLruMap<KeyType, ValueType, Hash>::num_recovery() const {
+  Lock lock{this};
+  return header_->num_recovery;
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _SHM_LRU_MAP_H_
@@ -0,0 +1,755 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides TenantLruMap, a variant of LruMap (see lru_map.h)
+ * shared by many tenants, whose entries are keyed by (tenant, key), and
+ * where every tenant has its own usage list, limits and statistics.
+ *
+ * In one LruMap, a tenant scanning many keys pushes out the working sets of
+ * all the others. Running a separate LruMap per tenant isolates them, but
+ * strands the capacity of the idle ones, and sizing thousands of them is
+ * impractical. In TenantLruMap, the tenants share one global capacity, and
+ * each may be given, with SetTenantLimits():
+ *
+ *  - A reservation, the number of entries it keeps whatever the others do.
+ *    The reservations must add up to at most the capacity. A reservation is
+ *    not held empty: others use it while the tenant is below it, and the
+ *    tenant takes it back as it inserts.
+ *
+ *  - A quota, the number of entries it may have at most. An insertion that
+ *    takes a tenant beyond its quota evicts the least recent entry of that
+ *    tenant.
+ *
+ * By default, the reservation is 0 and the quota is the capacity.
+ *
+ * The excess of a tenant is the number of its entries beyond its
+ * reservation. When an insertion takes the map beyond its capacity, the
+ * least recent entry of the tenant with the largest excess is evicted; if
+ * several tie, that of the one which reached it last. So a tenant growing
+ * beyond its fair share evicts its own entries, and the others keep theirs.
+ * If the rest of the capacity is reserved by others, the entry inserted by
+ * a tenant with no reservation left is evicted at once.
+ *
+ * The tenants with a positive excess are kept in buckets, one per excess.
+ * An insertion or an eviction moves a tenant by one bucket, and the bucket
+ * of the largest excess is found by stepping down from the previous one,
+ * so choosing the victim takes amortized constant time, however many
+ * tenants there are.
+ *
+ * A tenant is known to the map once it inserts or gets its limits set. Its
+ * limits and statistics are kept through ClearTenant() and Clear(), until
+ * EraseTenant() forgets the tenant altogether. A find for a tenant unknown
+ * to the map only counts in lru_map_stats(), so lookups with arbitrary
+ * tenant ids do not grow the map.
+ *
+ * The LockingStoragePolicy and LockingPolicy are the same as those of
+ * LruMap.
+ */
+
+#ifndef _TENANT_LRU_MAP_H_
+#define _TENANT_LRU_MAP_H_
+
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lru_map.h"
+
+// Occupancy, limits and counters of a tenant of a TenantLruMap.
+struct TenantLruMapTenantStats {
+  int64_t size{0};           // # of entries of the tenant.
+  int64_t reservation{0};    // # of entries the tenant keeps at least.
+  int64_t quota{0};          // # of entries the tenant may have at most.
+  int64_t num_insert{0};     // # of insertions by the tenant.
+  int64_t num_find_ok{0};    // # of finds by the tenant, only successful.
+  int64_t num_find_miss{0};  // # of finds by the tenant, only unsuccessful.
+  int64_t num_evict{0};      // # of entries of the tenant evicted.
+  std::string ToString() const;
+};
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy = LockStorageNone,
+          template <class> class LockingPolicy = LockNone>
+class TenantLruMap : public LockingStoragePolicy<void> {
+ public:
+  // Construct an object with specified 'capacity', shared by all tenants.
+  explicit TenantLruMap(int64_t capacity);
+
+  TenantLruMap(const TenantLruMap&) = delete;
+  TenantLruMap& operator=(const TenantLruMap&) = delete;
+
+  // Set the 'reservation' and the 'quota' of 'tenant', see above. If the
+  // tenant has more than 'quota' entries, its least recent ones are
+  // evicted.
+  void SetTenantLimits(const TenantType& tenant, int64_t reservation,
+                       int64_t quota);
+
+  // Insert or update an entry of 'tenant' with key 'key' and value 'value'.
+  //
+  // If an entry with 'key' already exists for 'tenant', then it is
+  // refreshed to be the most recent entry of 'tenant', and the value of the
+  // entry would be the new 'value' supplied.
+  //
+  // If 'tenant' exceeds its quota, or the map its capacity, then an entry
+  // is thrown away, see above.
+  void Insert(const TenantType& tenant, const KeyType& key,
+              const ValueType& value);
+
+  // Find the entry, if exists, of 'tenant' for the key 'key'. The returned
+  // pointer may become stale through other operations, the client is
+  // required to protect against that, for example by copying the object
+  // elsewhere.
+  const ValueType *Find(const TenantType& tenant, const KeyType& key);
+
+  // Return true iff an entry of 'tenant' with 'key' exists, false otherwise.
+  bool Exists(const TenantType& tenant, const KeyType& key) const;
+
+  // Erase the entry of 'tenant' with key 'key', if exists.
+  void Erase(const TenantType& tenant, const KeyType& key);
+
+  // Erase all entries of 'tenant'.
+  void ClearTenant(const TenantType& tenant);
+
+  // Erase all entries of 'tenant', and forget its limits and statistics.
+  void EraseTenant(const TenantType& tenant);
+
+  // Clear all entries in the map.
+  void Clear();
+
+  // Return the capacity, i.e. the maximum possible number of entries.
+  int64_t Capacity() const;
+
+  // Return the current number of entries, of all tenants.
+  int64_t Size() const;
+
+  // Return the number of tenants known to the map.
+  int64_t NumTenants() const;
+
+  // Audit the lists, the index and the buckets and return true iff they
+  // agree, false otherwise.
+  bool Valid() const;
+
+  // Return string representation of this object.
+  std::string ToString() const;
+
+  // Return a copy of the statistics.
+  LruMapStats lru_map_stats() const;
+
+  // Return a copy of the statistics of 'tenant'.
+  TenantLruMapTenantStats tenant_stats(const TenantType& tenant) const;
+
+ private:
+  typedef TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+    LockingPolicy> ThisType;
+
+  friend struct LockingPolicy<ThisType>;
+
+  struct TenantState;
+
+  struct KeyValueEntry {
+    KeyType key;
+    ValueType value;
+    TenantState *tenant_state;
+  };
+
+  typedef std::list<KeyValueEntry> ItemList;
+  typedef typename ItemList::iterator ItemListIter;
+
+  typedef std::pair<TenantType, KeyType> TenantKey;
+
+  struct TenantKeyHash {
+    size_t operator()(const TenantKey& tenant_key) const {
+      const size_t seed = std::hash<TenantType>()(tenant_key.first);
+      return seed ^ (std::hash<KeyType>()(tenant_key.second) +
+                     0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+    }
+  };
+
+  typedef std::unordered_map<TenantKey, ItemListIter, TenantKeyHash> ItemMap;
+  typedef typename ItemMap::iterator ItemMapIter;
+
+  struct TenantState {
+    TenantType tenant;
+
+    // The usage list of the tenant, the most recent entry at front.
+    ItemList lru_list;
+
+    TenantLruMapTenantStats stats;
+
+    // The excess, i.e. max(0, size - reservation), and the neighbors in its
+    // bucket, if positive.
+    int64_t excess{0};
+    TenantState *bucket_prev{nullptr};
+    TenantState *bucket_next{nullptr};
+  };
+
+  typedef std::unordered_map<TenantType, TenantState> TenantMap;
+
+  // Return the state of 'tenant', adding it if new.
+  TenantState& TenantOfPrivate(const TenantType& tenant);
+
+  // Move 'tenant_state' to the bucket of its current excess.
+  void UpdateExcessPrivate(TenantState *tenant_state);
+
+  // Return the tenant with the largest excess, nullptr if there is none.
+  TenantState *MostOverPrivate();
+
+  // Evict entries while 'tenant_state' is over its quota or the map is over
+  // its capacity.
+  void OverflowPrivate(TenantState *tenant_state);
+
+  // Evict the least recent entry of 'tenant_state', which is not empty.
+  void EvictPrivate(TenantState *tenant_state);
+
+  // Erase the entry at 'map_it'.
+  void ErasePrivate(ItemMapIter map_it);
+
+  // Erase all entries of 'tenant_state'.
+  void ClearTenantPrivate(TenantState *tenant_state);
+
+  // The capacity, i.e. maximum number of elements at a time.
+  const int64_t capacity_{0};
+
+  // Cumulative lifetime stats, persist on Clear().
+  LruMapStats lru_stats_;
+
+  // The tenants, whose states, being nodes, stay put as others are added.
+  TenantMap tenants_;
+
+  // The sum of the reservations of all tenants.
+  int64_t total_reservation_{0};
+
+  // The first tenant of the bucket of every excess, from 1 to capacity + 1,
+  // and an upper bound of the largest excess with a non-empty bucket.
+  std::vector<TenantState *> excess_buckets_;
+  int64_t max_excess_{0};
+
+  // Map (tenant, key) to the entries, in whichever tenant list.
+  ItemMap lru_key_map_;
+};
+
+// ----------------------------------------------------------------------------
+
+inline std::string TenantLruMapTenantStats::ToString() const {
+  std::ostringstream oss;
+  oss << "size = " << size;
+  oss << ", reservation = " << reservation;
+  oss << ", quota = " << quota;
+  oss << ", num_insert = " << num_insert;
+  oss << ", num_find_ok = " << num_find_ok;
+  oss << ", num_find_miss = " << num_find_miss;
+  oss << ", num_evict = " << num_evict;
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::TenantLruMap(const int64_t capacity) :
+  capacity_{capacity} {
+
+  CHECK_GE(capacity_, 1);
+  // An insertion takes a tenant at most one entry beyond the capacity,
+  // before it is evicted.
+  excess_buckets_.resize(capacity_ + 2, nullptr);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+typename TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::TenantState&
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::TenantOfPrivate(const TenantType& tenant) {
+  const size_t num_tenants = tenants_.size();
+  TenantState& tenant_state = tenants_[tenant];
+  if (tenants_.size() != num_tenants) {
+    tenant_state.tenant = tenant;
+    tenant_state.stats.quota = capacity_;
+  }
+  return tenant_state;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::UpdateExcessPrivate(TenantState *const tenant_state) {
+  const int64_t excess =
+    std::max<int64_t>(0, tenant_state->stats.size -
+                           tenant_state->stats.reservation);
+  if (excess == tenant_state->excess) {
+    return;
+  }
+
+  if (tenant_state->excess > 0) {
+    if (tenant_state->bucket_prev != nullptr) {
+      tenant_state->bucket_prev->bucket_next = tenant_state->bucket_next;
+    } else {
+      excess_buckets_[tenant_state->excess] = tenant_state->bucket_next;
+    }
+    if (tenant_state->bucket_next != nullptr) {
+      tenant_state->bucket_next->bucket_prev = tenant_state->bucket_prev;
+    }
+    tenant_state->bucket_prev = nullptr;
+    tenant_state->bucket_next = nullptr;
+  }
+
+  tenant_state->excess = excess;
+  if (excess > 0) {
+    DCHECK_LT(excess, static_cast<int64_t>(excess_buckets_.size()));
+    TenantState *const head = excess_buckets_[excess];
+    tenant_state->bucket_next = head;
+    if (head != nullptr) {
+      head->bucket_prev = tenant_state;
+    }
+    excess_buckets_[excess] = tenant_state;
+    max_excess_ = std::max(max_excess_, excess);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+typename TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::TenantState *
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::MostOverPrivate() {
+  // The largest excess only grows by one per insertion, which pays for
+  // stepping down here.
+  while (max_excess_ > 0 && excess_buckets_[max_excess_] == nullptr) {
+    --max_excess_;
+  }
+  return max_excess_ > 0 ? excess_buckets_[max_excess_] : nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::SetTenantLimits(const TenantType& tenant,
+                                  const int64_t reservation,
+                                  const int64_t quota) {
+  CHECK_GE(reservation, 0);
+  CHECK_GE(quota, 1);
+  CHECK_LE(reservation, quota);
+  CHECK_LE(quota, capacity_);
+
+  LockingPolicy<ThisType> lock{this};
+
+  TenantState& tenant_state = TenantOfPrivate(tenant);
+  const int64_t total_reservation =
+    total_reservation_ - tenant_state.stats.reservation + reservation;
+  CHECK_LE(total_reservation, capacity_)
+    << "Reservations exceed the capacity";
+  total_reservation_ = total_reservation;
+  tenant_state.stats.reservation = reservation;
+  tenant_state.stats.quota = quota;
+
+  while (tenant_state.stats.size > quota) {
+    EvictPrivate(&tenant_state);
+  }
+  UpdateExcessPrivate(&tenant_state);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Insert(const TenantType& tenant, const KeyType& key,
+                         const ValueType& value) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_insert += 1;
+
+  const TenantKey tenant_key{tenant, key};
+  const ItemMapIter map_it = lru_key_map_.find(tenant_key);
+  if (map_it != lru_key_map_.end()) {
+    KeyValueEntry& kv_entry = *map_it->second;
+    kv_entry.value = value;
+    TenantState *const tenant_state = kv_entry.tenant_state;
+    tenant_state->stats.num_insert += 1;
+    tenant_state->lru_list.splice(tenant_state->lru_list.begin(),
+                                  tenant_state->lru_list, map_it->second);
+    return;
+  }
+
+  TenantState& tenant_state = TenantOfPrivate(tenant);
+  tenant_state.stats.num_insert += 1;
+  tenant_state.lru_list.push_front(KeyValueEntry{key, value, &tenant_state});
+  const std::pair<ItemMapIter, bool> result =
+    lru_key_map_.insert({tenant_key, tenant_state.lru_list.begin()});
+  CHECK(result.second);
+  tenant_state.stats.size += 1;
+  UpdateExcessPrivate(&tenant_state);
+
+  OverflowPrivate(&tenant_state);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::OverflowPrivate(TenantState *const tenant_state) {
+  // The quota is at least one entry, so the most recent one is spared.
+  while (tenant_state->stats.size > tenant_state->stats.quota) {
+    lru_stats_.num_overflow += 1;
+    EvictPrivate(tenant_state);
+  }
+
+  // As the reservations add up to at most the capacity, a map over its
+  // capacity always has a tenant with a positive excess.
+  while (static_cast<int64_t>(lru_key_map_.size()) > capacity_) {
+    TenantState *const victim = MostOverPrivate();
+    CHECK(victim != nullptr);
+    lru_stats_.num_overflow += 1;
+    EvictPrivate(victim);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::EvictPrivate(TenantState *const tenant_state) {
+  DCHECK(!tenant_state->lru_list.empty());
+  tenant_state->stats.num_evict += 1;
+  ErasePrivate(lru_key_map_.find(
+    TenantKey{tenant_state->tenant, tenant_state->lru_list.back().key}));
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::ErasePrivate(const ItemMapIter map_it) {
+  DCHECK(map_it != lru_key_map_.end());
+  TenantState *const tenant_state = map_it->second->tenant_state;
+  tenant_state->lru_list.erase(map_it->second);
+  lru_key_map_.erase(map_it);
+  tenant_state->stats.size -= 1;
+  UpdateExcessPrivate(tenant_state);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+const ValueType *
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Find(const TenantType& tenant, const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_find += 1;
+
+  const ItemMapIter map_it = lru_key_map_.find(TenantKey{tenant, key});
+  if (map_it == lru_key_map_.end()) {
+    const typename TenantMap::iterator tenant_it = tenants_.find(tenant);
+    if (tenant_it != tenants_.end()) {
+      tenant_it->second.stats.num_find_miss += 1;
+    }
+    return nullptr;
+  }
+
+  KeyValueEntry& kv_entry = *map_it->second;
+  TenantState *const tenant_state = kv_entry.tenant_state;
+  lru_stats_.num_find_ok += 1;
+  tenant_state->stats.num_find_ok += 1;
+  tenant_state->lru_list.splice(tenant_state->lru_list.begin(),
+                                tenant_state->lru_list, map_it->second);
+  return &kv_entry.value;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+bool
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Exists(const TenantType& tenant,
+                         const KeyType& key) const {
+  LockingPolicy<ThisType> lock{this};
+  return lru_key_map_.find(TenantKey{tenant, key}) != lru_key_map_.end();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Erase(const TenantType& tenant, const KeyType& key) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  lru_stats_.num_erase += 1;
+
+  const ItemMapIter map_it = lru_key_map_.find(TenantKey{tenant, key});
+  if (map_it != lru_key_map_.end()) {
+    ErasePrivate(map_it);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::ClearTenant(const TenantType& tenant) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  const typename TenantMap::iterator tenant_it = tenants_.find(tenant);
+  if (tenant_it != tenants_.end()) {
+    ClearTenantPrivate(&tenant_it->second);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::EraseTenant(const TenantType& tenant) {
+
+  LockingPolicy<ThisType> lock{this};
+
+  const typename TenantMap::iterator tenant_it = tenants_.find(tenant);
+  if (tenant_it == tenants_.end()) {
+    return;
+  }
+  // Once empty, the tenant is in no bucket.
+  ClearTenantPrivate(&tenant_it->second);
+  total_reservation_ -= tenant_it->second.stats.reservation;
+  tenants_.erase(tenant_it);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::ClearTenantPrivate(TenantState *const tenant_state) {
+  for (const KeyValueEntry& kv_entry : tenant_state->lru_list) {
+    lru_key_map_.erase(TenantKey{tenant_state->tenant, kv_entry.key});
+  }
+  tenant_state->lru_list.clear();
+  tenant_state->stats.size = 0;
+  UpdateExcessPrivate(tenant_state);
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+void
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Clear() {
+
+  LockingPolicy<ThisType> lock{this};
+
+  for (auto& tenant_entry : tenants_) {
+    TenantState& tenant_state = tenant_entry.second;
+    tenant_state.lru_list.clear();
+    tenant_state.stats.size = 0;
+    UpdateExcessPrivate(&tenant_state);
+  }
+  lru_key_map_.clear();
+  max_excess_ = 0;
+  lru_stats_.num_clear += 1;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+inline int64_t
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Capacity() const {
+  return capacity_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+int64_t
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Size() const {
+  LockingPolicy<ThisType> lock{this};
+  return lru_key_map_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+int64_t
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::NumTenants() const {
+  LockingPolicy<ThisType> lock{this};
+  return tenants_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+bool
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::Valid() const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  int64_t num_entries = 0;
+  int64_t num_over = 0;
+  int64_t total_reservation = 0;
+  for (const auto& tenant_entry : tenants_) {
+    const TenantState& tenant_state = tenant_entry.second;
+    for (const KeyValueEntry& kv_entry : tenant_state.lru_list) {
+      const auto map_it =
+        lru_key_map_.find(TenantKey{tenant_entry.first, kv_entry.key});
+      if (map_it == lru_key_map_.end() || &*map_it->second != &kv_entry ||
+          kv_entry.tenant_state != &tenant_state) {
+        return false;
+      }
+    }
+    const int64_t size = tenant_state.lru_list.size();
+    if (size != tenant_state.stats.size || size > tenant_state.stats.quota ||
+        tenant_state.excess !=
+          std::max<int64_t>(0, size - tenant_state.stats.reservation)) {
+      return false;
+    }
+    num_entries += size;
+    num_over += tenant_state.excess > 0 ? 1 : 0;
+    total_reservation += tenant_state.stats.reservation;
+  }
+  if (num_entries != static_cast<int64_t>(lru_key_map_.size()) ||
+      total_reservation != total_reservation_) {
+    return false;
+  }
+
+  // Every tenant with a positive excess is in the bucket of its excess.
+  int64_t num_in_buckets = 0;
+  for (int64_t excess = 1;
+       excess != static_cast<int64_t>(excess_buckets_.size()); ++excess) {
+    const TenantState *prev = nullptr;
+    for (const TenantState *tenant_state = excess_buckets_[excess];
+         tenant_state != nullptr; tenant_state = tenant_state->bucket_next) {
+      if (tenant_state->excess != excess ||
+          tenant_state->bucket_prev != prev || excess > max_excess_) {
+        return false;
+      }
+      prev = tenant_state;
+      ++num_in_buckets;
+    }
+  }
+  return num_in_buckets == num_over;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+std::string
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::ToString() const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  std::ostringstream oss;
+  oss << "capacity = " << capacity_ << ", size = " << lru_key_map_.size()
+      << ", tenants = " << tenants_.size() << "\n";
+  for (const auto& tenant_entry : tenants_) {
+    const TenantState& tenant_state = tenant_entry.second;
+    oss << "tenant " << tenant_entry.first << ": "
+        << tenant_state.stats.ToString() << "\n";
+    for (const KeyValueEntry& kv_entry : tenant_state.lru_list) {
+      oss << kv_entry.key << "; " << kv_entry.value << "\n";
+    }
+  }
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+LruMapStats
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::lru_map_stats() const {
+  LockingPolicy<ThisType> lock{this};
+  return lru_stats_;
+}
+
+// ----------------------------------------------------------------------------
+
+template <typename TenantType, typename KeyType, typename ValueType,
+          template <class> class LockingStoragePolicy,
+          template <class> class LockingPolicy>
+TenantLruMapTenantStats
+TenantLruMap<TenantType, KeyType, ValueType, LockingStoragePolicy,
+  LockingPolicy>::tenant_stats(const TenantType& tenant) const {
+
+  LockingPolicy<ThisType> lock{this};
+
+  const typename TenantMap::const_iterator tenant_it = tenants_.find(tenant);
+  if (tenant_it == tenants_.end()) {
+    TenantLruMapTenantStats stats;
+    stats.quota = capacity_;
+    return stats;
+  }
+  return tenant_it->second.stats;
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _TENANT_LRU_MAP_H_
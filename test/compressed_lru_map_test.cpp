@@ -0,0 +1,283 @@
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "compressed_lru_map.h"
+
+using namespace std;
+
+typedef CompressedLruMap<int64_t> CompressedLruMapType;
+
+// Return a JSON like document of about 'size' bytes, which compresses well.
+static std::string Document(const int64_t id, const int64_t size) {
+  std::string doc = "{\"id\": " + std::to_string(id) + ", \"items\": [";
+  for (int64_t item = 0; static_cast<int64_t>(doc.size()) < size; ++item) {
+    doc += "{\"name\": \"item" + std::to_string(item) +
+           "\", \"price\": " + std::to_string(item * 7 % 100) +
+           ", \"in_stock\": true}, ";
+  }
+  return doc + "]}";
+}
+
+// Return 'size' random bytes, which do not compress.
+static std::string RandomBytes(std::mt19937 *rng, const int64_t size) {
+  std::uniform_int_distribution<int> bytes(0, 255);
+  std::string str(size, '\0');
+  for (char& c : str) {
+    c = static_cast<char>(bytes(*rng));
+  }
+  return str;
+}
+
+
+void Test1() {
+  LOG(INFO) << "Testing LzCodec";
+  std::mt19937 rng(39);
+  std::vector<std::string> inputs = {
+    "", "a", "abcd", "abcabcabcabcabc", std::string(10000, 'x'),
+    Document(1, 5000), RandomBytes(&rng, 3000)
+  };
+  // Long literal runs followed by long matches, beyond the 15 and 255
+  // length boundaries.
+  for (const int64_t size : {14, 15, 16, 269, 270, 271, 600}) {
+    const std::string random = RandomBytes(&rng, size);
+    inputs.push_back(random + random + random);
+  }
+  // Matches up to the largest offset, and beyond it.
+  const std::string block = RandomBytes(&rng, 70000);
+  inputs.push_back(block + block.substr(0, 1000));
+
+  std::string compressed;
+  std::string decompressed;
+  for (const std::string& input : inputs) {
+    LzCodec::Compress(input.data(), input.size(), &compressed);
+    CHECK(LzCodec::Decompress(compressed.data(), compressed.size(),
+                              input.size(), &decompressed));
+    CHECK(decompressed == input) << input.size();
+  }
+
+  LzCodec::Compress(inputs[4].data(), inputs[4].size(), &compressed);
+  CHECK_LT(compressed.size(), 100);
+  const std::string doc = Document(1, 5000);
+  LzCodec::Compress(doc.data(), doc.size(), &compressed);
+  CHECK_LT(compressed.size() * 3, doc.size());
+
+  // Corrupt input is rejected.
+  CHECK(!LzCodec::Decompress(compressed.data(), compressed.size(),
+                             doc.size() - 1, &decompressed));
+  CHECK(!LzCodec::Decompress(compressed.data(), compressed.size(),
+                             doc.size() + 1, &decompressed));
+  for (size_t size = 0; size != compressed.size(); size += 7) {
+    CHECK(!LzCodec::Decompress(compressed.data(), size, doc.size(),
+                               &decompressed));
+  }
+  for (int iter = 0; iter != 1000; ++iter) {
+    std::string garbage = compressed;
+    garbage[rng() % garbage.size()] = static_cast<char>(rng());
+    // Either rejected, or some string of the right size.
+    if (LzCodec::Decompress(garbage.data(), garbage.size(), doc.size(),
+                            &decompressed)) {
+      CHECK_EQ(decompressed.size(), doc.size());
+    }
+  }
+}
+
+
+void Test2() {
+  LOG(INFO) << "Testing compressed storage";
+  std::mt19937 rng(39);
+  CompressedLruMapType cache{8, 1024 /* threshold_bytes */};
+
+  const std::string small = "small value";
+  const std::string doc = Document(2, 16384);
+  const std::string random = RandomBytes(&rng, 4096);
+  cache.Insert(1, small);
+  cache.Insert(2, doc);
+  cache.Insert(3, random);
+
+  std::string value;
+  CHECK(cache.Find(1, &value));
+  CHECK_EQ(value, small);
+  CHECK(cache.Find(2, &value));
+  CHECK(value == doc);
+  const std::string *found = cache.Find(3);
+  CHECK(found != nullptr);
+  CHECK(*found == random);
+  CHECK(cache.Find(4) == nullptr);
+  CHECK(!cache.Find(4, &value));
+
+  const CompressedLruMapStats stats = cache.compression_stats();
+  LOG(INFO) << stats.ToString();
+  CHECK_EQ(stats.num_small, 1);
+  CHECK_EQ(stats.num_compressed, 1);
+  CHECK_EQ(stats.num_incompressible, 1);
+  CHECK_EQ(stats.raw_bytes, static_cast<int64_t>(doc.size()));
+  CHECK_GT(stats.CompressionRatio(), 3);
+  CHECK_EQ(stats.BytesSaved(), stats.raw_bytes - stats.compressed_bytes);
+  CHECK_EQ(stats.num_decompress, 1);
+
+  // The memory used reflects the compressed size.
+  const LruMapMemoryUsage usage = cache.MemoryUsage();
+  CHECK_LT(usage.payload_bytes,
+           static_cast<int64_t>(random.size() + doc.size() / 3));
+
+  // Updates and eviction behave as in LruMap.
+  cache.Insert(2, small);
+  CHECK_EQ(*cache.Find(2), small);
+  for (int64_t key = 10; key != 20; ++key) {
+    cache.Insert(key, Document(key, 2048));
+  }
+  CHECK_EQ(cache.Size(), 8);
+  CHECK(!cache.Exists(1));
+  CHECK(cache.Find(19, &value));
+  CHECK(value == Document(19, 2048));
+  cache.Erase(19);
+  CHECK(!cache.Exists(19));
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.lru_map_stats().num_clear, 1);
+
+  // The stored form survives serialization, as for a SecondTierPolicy.
+  CompressedValue stored;
+  stored.compressed = true;
+  stored.raw_size = doc.size();
+  LzCodec::Compress(doc.data(), doc.size(), &stored.bytes);
+  std::string bytes;
+  LruMapSerializer<CompressedValue>::Append(stored, &bytes);
+  CompressedValue parsed;
+  CHECK(LruMapSerializer<CompressedValue>::Parse(bytes.data(), bytes.size(),
+                                                 &parsed));
+  CHECK(parsed.compressed);
+  CHECK_EQ(parsed.raw_size, stored.raw_size);
+  CHECK(parsed.bytes == stored.bytes);
+  CHECK(!LruMapSerializer<CompressedValue>::Parse(bytes.data(), 3, &parsed));
+
+  // Raw sizes that the stored bytes cannot have are rejected.
+  for (const int64_t raw_size :
+         {int64_t{-1}, std::numeric_limits<int64_t>::min(),
+          static_cast<int64_t>(stored.bytes.size() * 256)}) {
+    stored.raw_size = raw_size;
+    bytes.clear();
+    LruMapSerializer<CompressedValue>::Append(stored, &bytes);
+    CHECK(!LruMapSerializer<CompressedValue>::Parse(bytes.data(),
+                                                    bytes.size(), &parsed))
+      << raw_size;
+  }
+  stored.compressed = false;
+  stored.bytes = small;
+  stored.raw_size = small.size() + 1;
+  bytes.clear();
+  LruMapSerializer<CompressedValue>::Append(stored, &bytes);
+  CHECK(!LruMapSerializer<CompressedValue>::Parse(bytes.data(), bytes.size(),
+                                                  &parsed));
+  stored.raw_size = small.size();
+  bytes.clear();
+  LruMapSerializer<CompressedValue>::Append(stored, &bytes);
+  CHECK(LruMapSerializer<CompressedValue>::Parse(bytes.data(), bytes.size(),
+                                                 &parsed));
+  CHECK_EQ(parsed.bytes, small);
+}
+
+
+// A shared map that cuts off the compressed values it stores.
+struct TruncatingLruMap : public LruMap<int64_t, CompressedValue> {
+  explicit TruncatingLruMap(const int64_t capacity) :
+    LruMap<int64_t, CompressedValue>{capacity} {
+  }
+
+  void Insert(const int64_t& key, const CompressedValue& value) {
+    CompressedValue stored = value;
+    if (stored.compressed) {
+      stored.bytes.pop_back();
+    }
+    LruMap<int64_t, CompressedValue>::Insert(key, stored);
+  }
+};
+
+void Test4() {
+  LOG(INFO) << "Testing corrupt values";
+  CompressedLruMap<int64_t, TruncatingLruMap> cache{8, 1024};
+  const std::string doc = Document(4, 8192);
+  cache.Insert(1, doc);
+  cache.Insert(2, "small value");
+
+  std::string value = "stale";
+  CHECK(!cache.Find(1, &value));
+  CHECK(value.empty());
+  CHECK(!cache.Exists(1));
+  CHECK(cache.Find(1) == nullptr);
+  CHECK_EQ(*cache.Find(2), "small value");
+  const CompressedLruMapStats stats = cache.compression_stats();
+  CHECK_EQ(stats.num_corrupt, 1);
+  CHECK_EQ(stats.num_decompress, 1);
+
+  // The codec itself rejects a raw size the input cannot expand to,
+  // before allocating it.
+  CHECK(!LzCodec::Decompress(doc.data(), 10, size_t{1} << 62, &value));
+}
+
+
+void Test5() {
+  LOG(INFO) << "Testing buffers of the calling thread";
+  CompressedLruMapType cache{8, 1024};
+  CompressedLruMapType other{8, 1024};
+  const std::string large = Document(5, 4 << 20);
+  const std::string doc = Document(6, 4096);
+  cache.Insert(1, large);
+  cache.Insert(2, doc);
+  other.Insert(3, doc);
+
+  // The buffer is shared by the maps of a type.
+  const std::string *found = cache.Find(1);
+  CHECK(found != nullptr);
+  CHECK(*found == large);
+  CHECK(other.Find(3) == found);
+  CHECK(*found == doc);
+
+  // Once a large value is done with, its memory is released.
+  CHECK(cache.Find(1) == found);
+  found = cache.Find(2);
+  CHECK(*found == doc);
+  CHECK_LT(found->capacity(), size_t{1} << 20);
+}
+
+
+void Test3() {
+  LOG(INFO) << "Testing concurrent access";
+  CompressedLruMapType cache{64, 256 /* threshold_bytes */};
+  const int kNumThreads = 4;
+  std::vector<std::thread> threads;
+  for (int thread_index = 0; thread_index != kNumThreads; ++thread_index) {
+    threads.emplace_back([&cache, thread_index] {
+      std::mt19937 rng(thread_index);
+      std::uniform_int_distribution<int64_t> keys(0, 127);
+      std::string value;
+      for (int iter = 0; iter != 5000; ++iter) {
+        const int64_t key = keys(rng);
+        // The value of a key is always the same, so any hit can be checked.
+        if (iter % 4 == 0) {
+          cache.Insert(key, Document(key, 64 * (key % 16)));
+        } else if (cache.Find(key, &value)) {
+          CHECK(value == Document(key, 64 * (key % 16)));
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  CHECK_LE(cache.Size(), 64);
+  LOG(INFO) << cache.compression_stats().ToString();
+}
+
+
+int main(int argc, char *argv[]) {
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  Test5();
+
+  LOG(INFO) << "All tests passed";
+}
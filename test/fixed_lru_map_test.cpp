@@ -0,0 +1,151 @@
+#include <random>
+#include "fixed_lru_map.h"
+
+using namespace std;
+
+struct LruKey {
+  explicit LruKey(int64_t k) : key(k) {}
+  bool operator==(const LruKey& rhs) const {
+    return key == rhs.key;
+  }
+  int64_t key;
+};
+
+std::ostream& operator<<(std::ostream& os, const LruKey& lrukey) {
+  os << lrukey.key;
+  return os;
+}
+
+namespace std {
+template <>
+struct hash<LruKey> {
+  size_t operator()(const LruKey& lrukey) const {
+    return hash<int64_t>()(lrukey.key);
+  }
+};
+}
+
+struct LruValue {
+  explicit LruValue(int32_t v) : value(v) {}
+  int32_t value;
+};
+
+std::ostream& operator<<(std::ostream& os, const LruValue& lruvalue) {
+  os << lruvalue.value;
+  return os;
+}
+
+
+template <class FixedLruMapType>
+void TestBasic() {
+  FixedLruMapType cache;
+  const int64_t capacity = cache.Capacity();
+
+  CHECK(cache.Valid());
+  CHECK_EQ(cache.Size(), 0);
+
+  // Insert N [0, N) elements, all of them are found.
+  for (int idx = 0; idx != capacity; ++idx) {
+    cache.Insert(LruKey{idx}, LruValue{5 * idx});
+    CHECK_EQ(cache.Size(), idx + 1);
+  }
+  for (int idx = 0; idx != capacity; ++idx) {
+    const LruValue *value = cache.Find(LruKey{idx});
+    CHECK(value);
+    CHECK_EQ(value->value, 5 * idx);
+  }
+  CHECK(cache.Valid());
+
+  // Insert N [N, 2N) more elements, they push out [0, N).
+  for (int idx = capacity; idx != 2 * capacity; ++idx) {
+    cache.Insert(LruKey{idx}, LruValue{5 * idx});
+    CHECK_EQ(cache.Size(), capacity);
+  }
+  for (int idx = 0; idx != capacity; ++idx) {
+    CHECK(!cache.Exists(LruKey{idx}));
+    CHECK(!cache.Find(LruKey{idx}));
+  }
+  for (int idx = capacity; idx != 2 * capacity; ++idx) {
+    CHECK(cache.Exists(LruKey{idx}));
+  }
+  CHECK(cache.Valid());
+
+  // Promote the least recent one, then overflow: the second least recent
+  // one is thrown away instead.
+  CHECK(cache.Find(LruKey{capacity}));
+  cache.Insert(LruKey{2 * capacity}, LruValue{0});
+  if (capacity > 1) {
+    CHECK(cache.Exists(LruKey{capacity}));
+    CHECK(!cache.Exists(LruKey{capacity + 1}));
+  } else {
+    cache.Insert(LruKey{capacity}, LruValue{0});
+  }
+
+  // Overwrite, Peek, Erase, Clear.
+  cache.Insert(LruKey{capacity}, LruValue{2016});
+  CHECK_EQ(cache.Peek(LruKey{capacity})->value, 2016);
+  cache.Erase(LruKey{capacity});
+  CHECK(!cache.Exists(LruKey{capacity}));
+  CHECK_EQ(cache.Size(), capacity - 1);
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  cache.Insert(LruKey{7}, LruValue{7});
+  CHECK_EQ(cache.Find(LruKey{7})->value, 7);
+
+  LOG(INFO) << "Stats: " << cache.lru_map_stats().ToString();
+}
+
+
+// Compare against a LruMap on a random workload.
+template <class FixedLruMapType>
+void TestRandom() {
+  FixedLruMapType cache;
+  LruMap<LruKey, LruValue> reference{cache.Capacity()};
+
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int64_t> key_distribution{
+    0, 3 * cache.Capacity()};
+  std::uniform_int_distribution<int> op_distribution{0, 9};
+  for (int iter = 0; iter != 100000; ++iter) {
+    const LruKey key{key_distribution(generator)};
+    const int op = op_distribution(generator);
+    if (op < 5) {
+      const LruValue *value = cache.Find(key);
+      const LruValue *expected = reference.Find(key);
+      CHECK_EQ(value == nullptr, expected == nullptr);
+      if (value) {
+        CHECK_EQ(value->value, expected->value);
+      }
+    } else if (op < 9) {
+      cache.Insert(key, LruValue{iter});
+      reference.Insert(key, LruValue{iter});
+    } else {
+      cache.Erase(key);
+      reference.Erase(key);
+    }
+    CHECK_EQ(cache.Size(), reference.Size());
+  }
+}
+
+
+int main(int argc, char *argv[]) {
+  LOG(INFO) << "Testing with default policies";
+  TestBasic<FixedLruMap<LruKey, LruValue, 1>>();
+  TestBasic<FixedLruMap<LruKey, LruValue, 8>>();
+
+  LOG(INFO) << "Testing with TimestampAll + HitCountEnabled";
+  TestBasic<FixedLruMap<LruKey, LruValue, 17, LockStorageNone, LockNone,
+    TimestampAll, HitCountEnabled>>();
+
+  LOG(INFO) << "Testing with LockStorageStdMutex + LockExclusiveStd + "
+            << "TimestampAll + HitCountEnabled + LogEventOverflow";
+  TestBasic<FixedLruMap<LruKey, LruValue, 4, LockStorageStdMutex,
+    LockExclusiveStd, TimestampAll, HitCountEnabled, LogEventOverflow>>();
+
+  LOG(INFO) << "Testing against LruMap";
+  TestRandom<FixedLruMap<LruKey, LruValue, 16>>();
+  TestRandom<FixedLruMap<LruKey, LruValue, 256>>();
+  TestRandom<FixedLruMap<LruKey, LruValue, 300>>();
+
+  LOG(INFO) << "All tests passed";
+}
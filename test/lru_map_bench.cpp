@@ -0,0 +1,288 @@
+// Micro benchmarks for LruMap and its variants. Build in release mode, e.g.
+//   cmake -DCMAKE_BUILD_TYPE=Release ..
+// and run ./test/lru_map_bench.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "compressed_lru_map.h"
+#include "fixed_lru_map.h"
+#include "lru_map.h"
+#include "lru_map_evictor.h"
+
+using namespace std;
+
+// Prevent the compiler from optimizing away the benchmarked work.
+static volatile int64_t benchmark_sink;
+
+// Return the keys of a workload of 'num_ops' lookups, uniformly distributed
+// over 'num_keys' distinct keys.
+static vector<int64_t>
+UniformKeys(const int64_t num_keys, const int64_t num_ops) {
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int64_t> distribution{0, num_keys - 1};
+  vector<int64_t> keys;
+  keys.reserve(num_ops);
+  for (int64_t op = 0; op != num_ops; ++op) {
+    keys.push_back(distribution(generator));
+  }
+  return keys;
+}
+
+// Run a read-through cache workload: each key is looked up and inserted on
+// a miss. Return the average nanoseconds per key.
+template <class Cache>
+static double
+FindOrInsert(Cache *cache, const vector<int64_t>& keys) {
+  int64_t sum = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (const int64_t key : keys) {
+    const int64_t *value = cache->Find(key);
+    if (value) {
+      sum += *value;
+    } else {
+      cache->Insert(key, key);
+    }
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  benchmark_sink = sum;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         keys.size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <int64_t kCapacity>
+static void
+BenchFixedLruMap() {
+  // Twice as many keys as the capacity, so that about half the lookups miss.
+  const vector<int64_t> keys = UniformKeys(2 * kCapacity, 4000000);
+
+  LruMap<int64_t, int64_t> lru_map{kCapacity};
+  const double lru_map_nsecs = FindOrInsert(&lru_map, keys);
+
+  FixedLruMap<int64_t, int64_t, kCapacity> fixed_lru_map;
+  const double fixed_lru_map_nsecs = FindOrInsert(&fixed_lru_map, keys);
+
+  printf("%8ld %16.1f %16.1f %8.2fx\n", static_cast<long>(kCapacity),
+         lru_map_nsecs, fixed_lru_map_nsecs,
+         lru_map_nsecs / fixed_lru_map_nsecs);
+}
+
+// Look up each of 'keys' with Find(). Return the average nanoseconds per key.
+template <class Cache>
+static double
+FindOnly(Cache *cache, const vector<int64_t>& keys) {
+  int64_t sum = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (const int64_t key : keys) {
+    const int64_t *value = cache->Find(key);
+    sum += value ? *value : 1;
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  benchmark_sink = sum;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+         keys.size();
+}
+
+// Compare Find() hit and miss latency of the default index and of
+// IndexSwissTable, for a map filled with the keys [0, 'size') shifted left
+// by 'shift' bits; a non-zero 'shift' gives strided keys that only differ
+// in their high bits, like aligned addresses.
+static void
+BenchIndex(const int64_t size, const int shift = 0) {
+  typedef LruMap<int64_t, int64_t> DefaultMap;
+  typedef LruMap<int64_t, int64_t, LockStorageNone, LockNone, TimestampNone,
+    HitCountDisabled, LogEventNone, PinNone, IndexSwissTable> SwissMap;
+
+  DefaultMap default_map{size};
+  SwissMap swiss_map{size};
+  for (int64_t key = 0; key != size; ++key) {
+    default_map.Insert(key << shift, key);
+    swiss_map.Insert(key << shift, key);
+  }
+
+  const int64_t num_ops = 2000000;
+  vector<int64_t> hit_keys = UniformKeys(size, num_ops);
+  vector<int64_t> miss_keys = UniformKeys(size, num_ops);
+  for (int64_t& key : hit_keys) {
+    key <<= shift;
+  }
+  for (int64_t& key : miss_keys) {
+    key = (key + size) << shift;
+  }
+
+  const double default_hit_nsecs = FindOnly(&default_map, hit_keys);
+  const double swiss_hit_nsecs = FindOnly(&swiss_map, hit_keys);
+  const double default_miss_nsecs = FindOnly(&default_map, miss_keys);
+  const double swiss_miss_nsecs = FindOnly(&swiss_map, miss_keys);
+
+  printf("%8ld %5d %12.1f %12.1f %12.1f %12.1f\n", static_cast<long>(size),
+         shift, default_hit_nsecs, swiss_hit_nsecs, default_miss_nsecs,
+         swiss_miss_nsecs);
+}
+
+// ----------------------------------------------------------------------------
+
+// Measure the latency of Clear() in 'mode' for a map of 'size' entries, in
+// milliseconds, and the time until the memory is released. Note that with
+// kOutsideLock the lock is held only briefly, but the caller still pays for
+// the destruction.
+static void
+BenchClear(const int64_t size, const LruMapClearMode mode,
+           const char *const mode_name) {
+  LruMap<int64_t, int64_t, LockStorageStdMutex, LockExclusiveStd> lru_map{
+    size};
+  for (int64_t key = 0; key != size; ++key) {
+    lru_map.Insert(key, key);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  lru_map.Clear(mode);
+  const auto cleared = std::chrono::steady_clock::now();
+  LruMapReclaimer::Instance()->Drain();
+  const auto reclaimed = std::chrono::steady_clock::now();
+
+  printf("%10ld %12s %12.3f %12.3f\n", static_cast<long>(size), mode_name,
+         std::chrono::duration<double, std::milli>(cleared - start).count(),
+         std::chrono::duration<double, std::milli>(reclaimed - start).count());
+}
+
+// ----------------------------------------------------------------------------
+
+// Measure the latency of Insert() of new keys with 'value_bytes' long
+// values into a full map, with overflow evicted inline or by an
+// LruMapEvictor. Print the median and the 99th percentile, in nanoseconds.
+static void
+BenchInsertLatency(const int64_t value_bytes, const bool background) {
+  typedef LruMap<int64_t, std::string, LockStorageStdMutex, LockExclusiveStd>
+    LruMapType;
+  const int64_t capacity = 100000;
+  LruMapType lru_map{capacity};
+  std::unique_ptr<LruMapEvictor<LruMapType>> evictor;
+  if (background) {
+    evictor.reset(new LruMapEvictor<LruMapType>{
+      &lru_map, capacity * 9 / 10, capacity * 12 / 10});
+  }
+
+  const std::string value(value_bytes, 'v');
+  const int64_t num_ops = 4 * capacity;
+  vector<double> nsecs;
+  nsecs.reserve(num_ops);
+  for (int64_t key = 0; key != num_ops; ++key) {
+    const auto start = std::chrono::steady_clock::now();
+    lru_map.Insert(key, value);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    nsecs.push_back(std::chrono::duration<double, std::nano>(elapsed).count());
+  }
+  std::sort(nsecs.begin(), nsecs.end());
+  printf("%12ld %12s %12.0f %12.0f\n", static_cast<long>(value_bytes),
+         background ? "background" : "inline", nsecs[num_ops / 2],
+         nsecs[num_ops * 99 / 100]);
+}
+
+// ----------------------------------------------------------------------------
+
+// Measure how a CompressedLruMap stores JSON like documents of about
+// 'value_bytes': the compression ratio, the payload memory per entry, and
+// the nanoseconds per Insert() and per Find(), against a plain LruMap.
+static void
+BenchCompression(const int64_t value_bytes) {
+  const int64_t capacity = 1000;
+  vector<std::string> values;
+  for (int64_t key = 0; key != capacity; ++key) {
+    std::string doc = "{\"id\": " + std::to_string(key) + ", \"items\": [";
+    for (int64_t item = 0; static_cast<int64_t>(doc.size()) < value_bytes;
+         ++item) {
+      doc += "{\"name\": \"item" + std::to_string(item * key % 997) +
+             "\", \"price\": " + std::to_string(item * 7 % 100) + "}, ";
+    }
+    values.push_back(doc + "]}");
+  }
+
+  // Return the average nanoseconds per call of 'op' for every key.
+  auto time_per_key = [capacity](const std::function<void(int64_t)>& op) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int64_t key = 0; key != capacity; ++key) {
+      op(key);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() /
+           capacity;
+  };
+
+  LruMap<int64_t, std::string> plain{capacity};
+  const double plain_insert_nsecs = time_per_key([&](const int64_t key) {
+    plain.Insert(key, values[key]);
+  });
+  std::string value;
+  const double plain_find_nsecs = time_per_key([&](const int64_t key) {
+    value = *plain.Find(key);
+  });
+
+  CompressedLruMap<int64_t> compressed{capacity};
+  const double insert_nsecs = time_per_key([&](const int64_t key) {
+    compressed.Insert(key, values[key]);
+  });
+  const double find_nsecs = time_per_key([&](const int64_t key) {
+    compressed.Find(key, &value);
+  });
+  benchmark_sink = value.size();
+
+  printf("%12ld %8.2f %12ld %12ld %10.0f %10.0f %10.0f %10.0f\n",
+         static_cast<long>(value_bytes),
+         compressed.compression_stats().CompressionRatio(),
+         static_cast<long>(plain.MemoryUsage().payload_bytes / capacity),
+         static_cast<long>(compressed.MemoryUsage().payload_bytes / capacity),
+         plain_insert_nsecs, insert_nsecs, plain_find_nsecs, find_nsecs);
+}
+
+// ----------------------------------------------------------------------------
+
+int main() {
+  printf("FindOrInsert, nsecs per op\n");
+  printf("%8s %16s %16s %9s\n", "capacity", "LruMap", "FixedLruMap",
+         "speedup");
+  BenchFixedLruMap<8>();
+  BenchFixedLruMap<16>();
+  BenchFixedLruMap<64>();
+  BenchFixedLruMap<256>();
+
+  printf("\nFind, nsecs per op\n");
+  printf("%8s %5s %12s %12s %12s %12s\n", "size", "shift", "hit:default",
+         "hit:swiss", "miss:default", "miss:swiss");
+  BenchIndex(1000);
+  BenchIndex(64000);
+  BenchIndex(1000000);
+  BenchIndex(64000, 16);
+  BenchIndex(64000, 32);
+
+  printf("\nClear, msecs\n");
+  printf("%10s %12s %12s %12s\n", "size", "mode", "Clear()", "reclaimed");
+  for (const int64_t size : {100000, 10000000}) {
+    BenchClear(size, LruMapClearMode::kInline, "inline");
+    BenchClear(size, LruMapClearMode::kOutsideLock, "outside_lock");
+    BenchClear(size, LruMapClearMode::kBackground, "background");
+  }
+
+  printf("\nInsert into a full map, nsecs\n");
+  printf("%12s %12s %12s %12s\n", "value_bytes", "eviction", "p50", "p99");
+  for (const int64_t value_bytes : {64, 4096}) {
+    BenchInsertLatency(value_bytes, false);
+    BenchInsertLatency(value_bytes, true);
+  }
+
+  printf("\nCompressed values, payload bytes per entry and nsecs per op\n");
+  printf("%12s %8s %12s %12s %10s %10s %10s %10s\n", "value_bytes", "ratio",
+         "plain:bytes", "lz:bytes", "plain:ins", "lz:ins", "plain:find",
+         "lz:find");
+  for (const int64_t value_bytes : {2048, 16384, 65536}) {
+    BenchCompression(value_bytes);
+  }
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lru_map_evictor.h"
+
+using namespace std;
+
+typedef LruMap<int64_t, std::string, LockStorageStdMutex,
+  LockExclusiveStd> LruMapType;
+
+// Wait up to a few seconds for 'lru_map' to shrink to 'size'. Return true
+// iff it did.
+static bool WaitForSize(const LruMapType& lru_map, const int64_t size) {
+  for (int iter = 0; iter != 5000; ++iter) {
+    if (lru_map.Size() <= size) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return false;
+}
+
+
+void Test1() {
+  LOG(INFO) << "Testing watermarks";
+  LruMapType cache{1000};
+  {
+    // A long interval, so that the thread stays out of the way while the
+    // map is filled.
+    LruMapEvictor<LruMapType> evictor{&cache, 900, 1200,
+                                      std::chrono::seconds{3600}};
+    CHECK_EQ(cache.OverflowLimit(), 1200);
+
+    // Let the first check, which the thread makes right away, pass on the
+    // empty map, so that it cannot evict while the map is filled.
+    while (evictor.evictor_stats().num_poll == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // Insert() evicts only above the high watermark.
+    for (int64_t key = 0; key != 1300; ++key) {
+      cache.Insert(key, std::string(100, 'x'));
+    }
+    CHECK_EQ(cache.Size(), 1200);
+    CHECK_EQ(cache.lru_map_stats().num_overflow, 100);
+    CHECK(!cache.Exists(99));
+    CHECK(cache.Exists(100));
+  }
+  // The limit is restored, the next Insert() evicts down to the capacity.
+  CHECK_EQ(cache.OverflowLimit(), 1000);
+  cache.Insert(5000, "x");
+  CHECK_EQ(cache.Size(), 1000);
+  CHECK(cache.Exists(5000));
+
+  // A limit set before the evictor is restored, not reset to the capacity.
+  cache.SetOverflowLimit(1100);
+  {
+    LruMapEvictor<LruMapType> evictor{&cache, 1000, 1200,
+                                      std::chrono::seconds{3600}};
+    CHECK_EQ(cache.OverflowLimit(), 1200);
+  }
+  CHECK_EQ(cache.OverflowLimit(), 1100);
+  cache.SetOverflowLimit(1000);
+
+  // The thread evicts down to the low watermark, the least recent first.
+  LruMapEvictor<LruMapType> evictor{&cache, 900, 1200,
+                                    std::chrono::microseconds{100}, 16};
+  CHECK(WaitForSize(cache, 900));
+  CHECK(cache.Exists(5000));
+  CHECK(!cache.Exists(400));
+  CHECK_GE(evictor.evictor_stats().num_evict, 100);
+  CHECK_GE(evictor.evictor_stats().num_run, 1);
+  CHECK(cache.Valid());
+  LOG(INFO) << "Evictor stats: " << evictor.evictor_stats().ToString();
+}
+
+
+void Test2() {
+  LOG(INFO) << "Testing concurrent inserts";
+  LruMapType cache{1000};
+  LruMapEvictor<LruMapType> evictor{&cache, 800, 1500,
+                                    std::chrono::microseconds{200}};
+
+  std::vector<std::thread> threads;
+  for (int thread_idx = 0; thread_idx != 4; ++thread_idx) {
+    threads.emplace_back([&cache, thread_idx] {
+      for (int64_t idx = 0; idx != 50000; ++idx) {
+        cache.Insert(thread_idx * 1000000 + idx, std::string(64, 'v'));
+        CHECK_LE(cache.Size(), 1500);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  CHECK(WaitForSize(cache, 800));
+  CHECK_GT(evictor.evictor_stats().num_evict, 0);
+  CHECK(cache.Valid());
+  LOG(INFO) << "Stats: " << cache.lru_map_stats().ToString();
+}
+
+
+void Test3() {
+  LOG(INFO) << "Testing idle backoff";
+  LruMapType cache{1000};
+  LruMapEvictor<LruMapType> evictor{&cache, 900, 1200,
+                                    std::chrono::microseconds{100}};
+
+  // Idle, the thread polls far less often than every interval.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  const LruMapEvictorStats idle = evictor.evictor_stats();
+  CHECK_LT(idle.num_poll, 200);
+  CHECK_EQ(idle.num_run, 0);
+
+  // It still notices new work, within its longest sleep.
+  for (int64_t key = 0; key != 1100; ++key) {
+    cache.Insert(key, "x");
+  }
+  CHECK(WaitForSize(cache, 900));
+  CHECK_EQ(evictor.evictor_stats().num_evict, 200);
+  CHECK_EQ(cache.lru_map_stats().num_overflow, 0);
+  LOG(INFO) << "Evictor stats: " << evictor.evictor_stats().ToString();
+}
+
+
+int main(int argc, char *argv[]) {
+  Test1();
+  Test2();
+  Test3();
+
+  LOG(INFO) << "All tests passed";
+}
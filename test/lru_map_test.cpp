@@ -1,4 +1,14 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <chrono>
 #include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 #include "lru_map.h"
 
 using namespace std;
@@ -232,12 +242,606 @@ void Test5() {
 }
 
 
+void Test6() {
+  LOG(INFO) << "Testing Lookup with PinKeepAlive";
+  typedef LruMap<LruKey, LruValue, LockStorageStdMutex, LockExclusiveStd,
+    TimestampAll, HitCountEnabled, LogEventNone, PinKeepAlive> MyLruMapType;
+  MyLruMapType cache{2};
+
+  cache.Insert(LruKey{1}, LruValue{10});
+  CHECK(!cache.Lookup(LruKey{2}));
+  MyLruMapType::ValueHandle handle = cache.Lookup(LruKey{1});
+  CHECK(handle);
+  CHECK_EQ(handle->value, 10);
+
+  // An overwrite leaves the pinned value intact.
+  cache.Insert(LruKey{1}, LruValue{11});
+  CHECK_EQ(handle->value, 10);
+  CHECK_EQ(cache.Find(LruKey{1})->value, 11);
+
+  // Eviction removes the entry from the map, but the handle keeps it alive.
+  MyLruMapType::ValueHandle handle2 = cache.Lookup(LruKey{1});
+  MyLruMapType::ValueHandle handle3 = handle2;
+  cache.Insert(LruKey{2}, LruValue{20});
+  cache.Insert(LruKey{3}, LruValue{30});
+  CHECK(!cache.Exists(LruKey{1}));
+  CHECK_EQ(cache.Size(), 2);
+  CHECK_EQ(handle2->value, 11);
+  handle2.Reset();
+  CHECK(!handle2);
+  CHECK_EQ((*handle3).value, 11);
+
+  cache.Clear();
+  CHECK_EQ(handle->value, 10);
+  LOG(INFO) << "Stats: " << cache.lru_map_stats().ToString();
+}
+
+
+void Test7() {
+  LOG(INFO) << "Testing Lookup with PinResident";
+  typedef LruMap<LruKey, LruValue, LockStorageNone, LockNone, TimestampNone,
+    HitCountDisabled, LogEventNone, PinResident> MyLruMapType;
+  MyLruMapType cache{2};
+
+  cache.Insert(LruKey{1}, LruValue{10});
+  cache.Insert(LruKey{2}, LruValue{20});
+  {
+    // The pinned, and least recent, entry is skipped by eviction.
+    const MyLruMapType::ValueHandle handle = cache.Lookup(LruKey{1});
+    cache.Find(LruKey{2});
+    cache.Insert(LruKey{3}, LruValue{30});
+    CHECK(cache.Exists(LruKey{1}));
+    CHECK(!cache.Exists(LruKey{2}));
+    CHECK_EQ(handle->value, 10);
+
+    // With every other entry pinned the map grows beyond its capacity.
+    const MyLruMapType::ValueHandle handle3 = cache.Lookup(LruKey{3});
+    cache.Insert(LruKey{4}, LruValue{40});
+    CHECK_EQ(cache.Size(), 3);
+  }
+
+  // Once unpinned, the entries are evictable again.
+  cache.Insert(LruKey{5}, LruValue{50});
+  CHECK_EQ(cache.Size(), 2);
+  CHECK(cache.Exists(LruKey{4}));
+  CHECK(cache.Exists(LruKey{5}));
+
+  // Pinned entries at the back of the list are stepped over once, and
+  // then treated as recently used.
+  MyLruMapType big{100};
+  for (int idx = 0; idx != 100; ++idx) {
+    big.Insert(LruKey{idx}, LruValue{idx});
+  }
+  std::vector<MyLruMapType::ValueHandle> handles;
+  for (int idx = 0; idx != 50; ++idx) {
+    handles.push_back(big.Lookup(LruKey{idx}));
+  }
+  for (int idx = 50; idx != 100; ++idx) {
+    big.Find(LruKey{idx});
+  }
+  CHECK_EQ(big.EvictN(10), 10);
+  for (int idx = 0; idx != 100; ++idx) {
+    CHECK_EQ(big.Exists(LruKey{idx}), idx < 50 || idx >= 60) << idx;
+  }
+  std::vector<int64_t> keys;
+  big.ForEachInLruOrder([&keys](const LruKey& key, const LruValue&) {
+    keys.push_back(key.key);
+  });
+  CHECK_EQ(keys.size(), 90u);
+  CHECK_EQ(keys[0], 60);
+  CHECK_EQ(keys[39], 99);
+  CHECK_LT(keys[40], 50);
+  CHECK(big.Valid());
+}
+
+
+void Test8() {
+  LOG(INFO) << "Testing Peek, ForEach* and Evict*";
+  typedef LruMap<LruKey, LruValue, LockStorageStdMutex, LockExclusiveStd,
+    TimestampAll, HitCountEnabled> MyLruMapType;
+  MyLruMapType cache{8};
+  for (int idx = 0; idx != 8; ++idx) {
+    cache.Insert(LruKey{idx}, LruValue{idx});
+  }
+
+  // Peek does not promote, so 0 stays the least recent.
+  CHECK_EQ(cache.Peek(LruKey{0})->value, 0);
+  CHECK(!cache.Peek(LruKey{8}));
+  CHECK_EQ(cache.lru_map_stats().num_find, 0);
+
+  std::vector<int64_t> keys;
+  const auto collect = [&keys](const LruKey& key, const LruValue&) {
+    keys.push_back(key.key);
+  };
+  cache.ForEachInLruOrder(collect, 3 /* chunk_size */);
+  CHECK_EQ(keys.size(), 8u);
+  for (int idx = 0; idx != 8; ++idx) {
+    CHECK_EQ(keys[idx], idx);
+  }
+
+  keys.clear();
+  cache.ForEachMostRecent(3, collect, 2 /* chunk_size */);
+  CHECK_EQ(keys.size(), 3u);
+  CHECK_EQ(keys[0], 7);
+  CHECK_EQ(keys[2], 5);
+
+  CHECK_EQ(cache.EvictN(2), 2);
+  CHECK(!cache.Exists(LruKey{0}));
+  CHECK(!cache.Exists(LruKey{1}));
+
+  const int64_t num_evicted = cache.EvictColdest(
+    [](const LruKey& key, const LruValue&) { return key.key < 4; });
+  CHECK_EQ(num_evicted, 2);
+  CHECK_EQ(cache.Size(), 4);
+  CHECK(cache.Exists(LruKey{4}));
+
+  CHECK_EQ(cache.EvictN(10), 4);
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.lru_map_stats().num_evict, 8);
+}
+
+
+void Test9() {
+  LOG(INFO) << "Testing with IndexSwissTable";
+  typedef LruMap<LruKey, LruValue, LockStorageNone, LockNone, TimestampAll,
+    HitCountEnabled, LogEventNone, PinNone, IndexSwissTable> MyLruMapType;
+  LruMapTest<MyLruMapType> test{kLruCapacity};
+  test.Test();
+
+  // Compare against the default index on a random workload, large enough
+  // for the table to grow and to accumulate deleted slots.
+  const int64_t capacity = 1000;
+  MyLruMapType cache{capacity};
+  LruMap<LruKey, LruValue> reference{capacity};
+  std::default_random_engine generator;
+  std::uniform_int_distribution<int64_t> key_distribution{0, 3 * capacity};
+  std::uniform_int_distribution<int> op_distribution{0, 9};
+  for (int iter = 0; iter != 200000; ++iter) {
+    const LruKey key{key_distribution(generator)};
+    const int op = op_distribution(generator);
+    if (op < 5) {
+      const LruValue *value = cache.Find(key);
+      const LruValue *expected = reference.Find(key);
+      CHECK_EQ(value == nullptr, expected == nullptr);
+      if (value) {
+        CHECK_EQ(value->value, expected->value);
+      }
+    } else if (op < 9) {
+      cache.Insert(key, LruValue{iter});
+      reference.Insert(key, LruValue{iter});
+    } else {
+      cache.Erase(key);
+      reference.Erase(key);
+    }
+    CHECK_EQ(cache.Size(), reference.Size());
+  }
+  cache.Clear();
+  CHECK(!cache.Find(LruKey{0}));
+  cache.Insert(LruKey{0}, LruValue{0});
+  CHECK(cache.Find(LruKey{0}));
+
+  // Keys that differ only in their high bits, like aligned addresses, must
+  // spread over the groups too; clustered, this takes quadratic time.
+  typedef LruMap<int64_t, int64_t, LockStorageNone, LockNone, TimestampNone,
+    HitCountDisabled, LogEventNone, PinNone, IndexSwissTable> StridedMap;
+  for (const int shift : {16, 24, 32, 40, 48}) {
+    const int64_t num_keys = 20000;
+    StridedMap strided{num_keys};
+    for (int64_t idx = 0; idx != num_keys; ++idx) {
+      strided.Insert(idx << shift, idx);
+    }
+    for (int64_t idx = 0; idx != num_keys; ++idx) {
+      CHECK_EQ(*strided.Find(idx << shift), idx) << shift;
+      CHECK(!strided.Find((idx << shift) + 1)) << shift;
+    }
+    CHECK_EQ(strided.Size(), num_keys);
+  }
+}
+
+
+// Return the heap memory of the keys and values in 'cache', by visiting
+// every entry.
+template <class MyLruMapType>
+int64_t VisitPayloadBytes(const MyLruMapType& cache) {
+  int64_t payload_bytes = 0;
+  cache.ForEachInLruOrder(
+    [&payload_bytes](const std::string& key, const std::string& value) {
+      payload_bytes += LruMapPayload<std::string>::Bytes(key) +
+                       LruMapPayload<std::string>::Bytes(value);
+    });
+  return payload_bytes;
+}
+
+
+template <class MyLruMapType>
+void TestMemoryUsage() {
+  MyLruMapType cache{4};
+  const std::string short_string{"short"};
+  const std::string long_string(1000, 'x');
+
+  LruMapMemoryUsage usage = cache.MemoryUsage();
+  CHECK_EQ(usage.num_entries, 0);
+  CHECK_EQ(usage.payload_bytes, 0);
+
+  // Only the long string has heap memory of its own.
+  cache.Insert(short_string, long_string);
+  usage = cache.MemoryUsage();
+  LOG(INFO) << "Memory usage: " << usage.ToString();
+  const int64_t long_string_bytes = LruMapPayload<std::string>::Bytes(
+    long_string);
+  CHECK_GE(long_string_bytes, 1000);
+  CHECK_EQ(usage.num_entries, 1);
+  CHECK_EQ(usage.payload_bytes, long_string_bytes);
+  CHECK_GT(usage.entry_bytes, 2 * static_cast<int64_t>(sizeof(std::string)));
+  CHECK_GT(usage.bucket_bytes, 0);
+  CHECK_GT(usage.TotalBytes(), long_string_bytes);
+
+  // A long key is accounted for in the entry.
+  cache.Insert(long_string, short_string);
+  CHECK_EQ(cache.MemoryUsage().payload_bytes, 2 * long_string_bytes);
+
+  // Overwrite, overflow and erase keep the accounting exact.
+  cache.Insert(short_string, short_string);
+  CHECK_EQ(cache.MemoryUsage().payload_bytes, VisitPayloadBytes(cache));
+  for (int idx = 0; idx != 6; ++idx) {
+    cache.Insert(std::to_string(idx), idx % 2 ? long_string : short_string);
+    CHECK_EQ(cache.MemoryUsage().payload_bytes, VisitPayloadBytes(cache));
+  }
+  cache.Erase("5");
+  usage = cache.MemoryUsage();
+  CHECK_EQ(usage.num_entries, 3);
+  CHECK_EQ(usage.payload_bytes, long_string_bytes);
+  CHECK_EQ(usage.payload_bytes, VisitPayloadBytes(cache));
+  LOG(INFO) << "Memory usage: " << usage.ToString();
+
+  cache.Clear();
+  usage = cache.MemoryUsage();
+  CHECK_EQ(usage.num_entries, 0);
+  CHECK_EQ(usage.payload_bytes, 0);
+  CHECK_EQ(usage.index_bytes, 0);
+}
+
+
+void Test10() {
+  LOG(INFO) << "Testing MemoryUsage";
+  TestMemoryUsage<LruMap<std::string, std::string>>();
+  TestMemoryUsage<LruMap<std::string, std::string, LockStorageNone, LockNone,
+    TimestampAll, HitCountEnabled, LogEventNone, PinKeepAlive,
+    IndexSwissTable>>();
+}
+
+
+void Test11() {
+  LOG(INFO) << "Testing hot key tracking";
+  typedef LruMap<int, int, LockStorageNone, LockNone, TimestampNone,
+    HitCountDisabled, LogEventNone, PinNone, IndexStdUnorderedMap,
+    HotKeySpaceSaving> LruMapType;
+
+  LruMapType cache(100);
+  CHECK(cache.HotKeys(10).empty());
+
+  // Three hot keys among a stream of cold ones. Key 7 is never inserted, so
+  // all of its finds miss.
+  std::mt19937 rng(11);
+  std::uniform_int_distribution<int> cold_keys(1000, 1000000);
+  cache.Insert(5, 5);
+  cache.Insert(6, 6);
+  for (int i = 0; i < 20000; ++i) {
+    cache.Find(5);
+    if (i % 2 == 0) {
+      cache.Find(6);
+    }
+    if (i % 4 == 0) {
+      cache.Find(7);
+    }
+    for (int j = 0; j < 4; ++j) {
+      const int key = cold_keys(rng);
+      if (!cache.Find(key)) {
+        cache.Insert(key, key);
+      }
+    }
+  }
+
+  std::vector<HotKey<int>> hot_keys = cache.HotKeys(3);
+  CHECK_EQ(hot_keys.size(), 3);
+  CHECK_EQ(hot_keys[0].key, 5);
+  CHECK_EQ(hot_keys[1].key, 6);
+  CHECK_EQ(hot_keys[2].key, 7);
+  for (const HotKey<int>& hot_key : hot_keys) {
+    CHECK_GE(hot_key.error, 0);
+    CHECK_GE(hot_key.count, hot_key.num_miss + hot_key.num_insert);
+  }
+  CHECK_EQ(hot_keys[0].num_miss, 0);
+  CHECK_GT(hot_keys[2].num_miss, 0);
+  CHECK_LE(hot_keys[2].count, hot_keys[2].num_miss + hot_keys[2].error);
+
+  // The window slides: once other keys are hot, the old ones fade away.
+  for (int i = 0; i < 200000; ++i) {
+    cache.Find(8 + i % 2);
+  }
+  hot_keys = cache.HotKeys(64);
+  CHECK_GE(hot_keys.size(), 2);
+  for (const HotKey<int>& hot_key : hot_keys) {
+    CHECK(hot_key.key == 8 || hot_key.key == 9) << hot_key.key;
+  }
+  CHECK(cache.Valid());
+}
+
+
+template <class LruMapType>
+void TestClearMode(const LruMapClearMode mode) {
+  const int kNumEntries = 10000;
+  LruMapType cache{kNumEntries};
+  for (int round = 0; round != 3; ++round) {
+    for (int key = 0; key != kNumEntries; ++key) {
+      cache.Insert(std::to_string(key), std::string(40, 'a' + round));
+    }
+    CHECK_EQ(cache.Size(), kNumEntries);
+    cache.Clear(mode);
+    CHECK_EQ(cache.Size(), 0);
+    CHECK(!cache.Exists("0"));
+    CHECK(cache.Valid());
+    const LruMapMemoryUsage usage = cache.MemoryUsage();
+    CHECK_EQ(usage.num_entries, 0);
+    CHECK_EQ(usage.payload_bytes, 0);
+  }
+  cache.Insert("1", "one");
+  CHECK_EQ(*cache.Find("1"), "one");
+  CHECK_EQ(cache.lru_map_stats().num_clear, 3);
+}
+
+
+void Test12() {
+  LOG(INFO) << "Testing Clear modes";
+  typedef LruMap<std::string, std::string, LockStorageStdMutex,
+    LockExclusiveStd> DefaultMap;
+  typedef LruMap<std::string, std::string, LockStorageStdMutex,
+    LockExclusiveStd, TimestampNone, HitCountDisabled, LogEventNone,
+    PinKeepAlive, IndexSwissTable> SwissMap;
+
+  LruMapReclaimer *const reclaimer = LruMapReclaimer::Instance();
+  const int64_t num_reclaimed = reclaimer->num_reclaimed();
+  for (const LruMapClearMode mode :
+       {LruMapClearMode::kInline, LruMapClearMode::kOutsideLock,
+        LruMapClearMode::kBackground}) {
+    TestClearMode<DefaultMap>(mode);
+    TestClearMode<SwissMap>(mode);
+  }
+  reclaimer->Drain();
+  // The list and the index of each of the background clears.
+  CHECK_EQ(reclaimer->num_reclaimed() - num_reclaimed, 2 * 2 * 3);
+
+  // Pinned entries outlive a background clear.
+  SwissMap cache{4};
+  cache.Insert("1", "one");
+  cache.Insert("2", "two");
+  SwissMap::ValueHandle handle = cache.Lookup("1");
+  cache.Clear(LruMapClearMode::kBackground);
+  reclaimer->Drain();
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(*handle, "one");
+  handle.Reset();
+  CHECK(cache.Valid());
+}
+
+
+void Test13() {
+  LOG(INFO) << "Testing SecondTierFile";
+  typedef LruMap<int64_t, std::string, LockStorageNone, LockNone,
+    TimestampNone, HitCountDisabled, LogEventNone, PinNone,
+    IndexStdUnorderedMap, HotKeyNone, SecondTierFile> LruMapType;
+
+  const int kCapacity = 100;
+  LruMapType cache{kCapacity};
+  // 4 segments of 4 KB, each holding about 90 records of 46 bytes.
+  cache.OpenSecondTier("/tmp/lru_map_test_tier_" + std::to_string(getpid()),
+                       16 << 10, 4 << 10, 512);
+
+  auto value_of = [](const int64_t key, const int version) {
+    return "value-" + std::to_string(version) + "-" +
+           std::string(20, 'a' + key % 26);
+  };
+  for (int64_t key = 0; key != 1000; ++key) {
+    cache.Insert(key, value_of(key, 0));
+  }
+  CHECK_EQ(cache.Size(), kCapacity);
+  LruMapStats stats = cache.lru_map_stats();
+  CHECK_EQ(stats.num_tier_write, 900);
+  CHECK_GT(cache.SecondTierSize(), 200);
+  CHECK_LT(cache.SecondTierSize(), 400);
+
+  // Let the writer thread catch up, so that reads of all but the last
+  // records, which are still buffered, go to the file.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  // The most recently evicted entries are promoted, the oldest are gone.
+  const std::string *value = cache.Find(850);
+  CHECK(value);
+  CHECK_EQ(*value, value_of(850, 0));
+  CHECK(cache.Exists(850));
+  CHECK_EQ(cache.Size(), kCapacity);
+  CHECK(!cache.Find(0));
+  stats = cache.lru_map_stats();
+  CHECK_EQ(stats.num_tier_find, 2);
+  CHECK_EQ(stats.num_tier_find_ok, 1);
+  CHECK_GT(stats.tier_read_bytes, 0);
+
+  // Erased and overwritten entries are never served from the tier.
+  cache.Erase(898);
+  CHECK(!cache.Find(898));
+  cache.Insert(897, value_of(897, 1));
+  CHECK_EQ(*cache.Find(897), value_of(897, 1));
+
+  // Random operations, a found value is always the latest one.
+  std::unordered_map<int64_t, int> versions;
+  for (int64_t key = 0; key != 1000; ++key) {
+    versions[key] = key == 897 ? 1 : 0;
+  }
+  versions.erase(898);
+  std::mt19937 rng(35);
+  std::uniform_int_distribution<int64_t> keys(0, 999);
+  for (int iter = 0; iter != 20000; ++iter) {
+    const int64_t key = keys(rng);
+    const int op = iter % 10;
+    if (op < 6) {
+      value = cache.Find(key);
+      if (value) {
+        CHECK(versions.count(key)) << key;
+        CHECK_EQ(*value, value_of(key, versions[key]));
+      }
+    } else if (op < 9) {
+      versions[key] = iter;
+      cache.Insert(key, value_of(key, iter));
+    } else {
+      versions.erase(key);
+      cache.Erase(key);
+    }
+  }
+  CHECK(cache.Valid());
+  stats = cache.lru_map_stats();
+  CHECK_GT(stats.num_tier_find_ok, 0);
+  LOG(INFO) << "Stats: " << stats.ToString();
+
+  cache.Clear();
+  CHECK_EQ(cache.SecondTierSize(), 0);
+  CHECK(!cache.Find(850));
+}
+
+
+// Return a new descriptor of the open, unlinked, file whose path contained
+// 'name', or -1 if there is none.
+static int ReopenDeletedFile(const std::string& name) {
+  for (int fd = 0; fd != 1024; ++fd) {
+    const std::string link = "/proc/self/fd/" + std::to_string(fd);
+    char target[256];
+    const ssize_t size = readlink(link.c_str(), target, sizeof target - 1);
+    if (size > 0 &&
+        std::string(target, size).find(name) != std::string::npos) {
+      return open(link.c_str(), O_RDWR);
+    }
+  }
+  return -1;
+}
+
+void Test14() {
+  LOG(INFO) << "Testing SecondTierFile errors";
+  typedef LruMap<int64_t, std::string, LockStorageNone, LockNone,
+    TimestampNone, HitCountDisabled, LogEventNone, PinNone,
+    IndexStdUnorderedMap, HotKeyNone, SecondTierFile> LruMapType;
+  const std::string value(30, 'v');
+
+  // The file cannot be created.
+  {
+    LruMapType cache{10};
+    CHECK(!cache.OpenSecondTier("/nonexistent/tier", 16 << 10, 4 << 10));
+    for (int64_t key = 0; key != 100; ++key) {
+      cache.Insert(key, value);
+    }
+    CHECK(!cache.Find(0));
+    CHECK_EQ(cache.lru_map_stats().num_tier_write, 0);
+  }
+
+  // A record cut off by the end of the file is a miss.
+  {
+    const std::string name =
+      "lru_map_test_short_" + std::to_string(getpid());
+    LruMapType cache{100};
+    CHECK(cache.OpenSecondTier("/tmp/" + name, 16 << 10, 4 << 10, 512));
+    for (int64_t key = 0; key != 1000; ++key) {
+      cache.Insert(key, value);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    const int fd = ReopenDeletedFile(name);
+    CHECK_GE(fd, 0);
+    CHECK_EQ(ftruncate(fd, 0), 0);
+    close(fd);
+
+    CHECK(!cache.Find(850));
+    LruMapStats stats = cache.lru_map_stats();
+    CHECK_EQ(stats.num_tier_error, 1);
+    CHECK_EQ(stats.num_tier_find_ok, 0);
+    cache.Insert(850, value);
+    CHECK_EQ(*cache.Find(850), value);
+  }
+
+  // After a failed write, the tier turns itself off.
+  {
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit old_limit;
+    CHECK_EQ(getrlimit(RLIMIT_FSIZE, &old_limit), 0);
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = 4096;
+    CHECK_EQ(setrlimit(RLIMIT_FSIZE, &limit), 0);
+
+    LruMapType cache{100};
+    CHECK(cache.OpenSecondTier(
+      "/tmp/lru_map_test_full_" + std::to_string(getpid()), 16 << 10,
+      4 << 10, 512));
+    int64_t key = 0;
+    for (int iter = 0;
+         iter != 1000 && cache.lru_map_stats().num_tier_error == 0; ++iter) {
+      for (int idx = 0; idx != 100; ++idx, ++key) {
+        cache.Insert(key, value);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK_EQ(setrlimit(RLIMIT_FSIZE, &old_limit), 0);
+
+    LruMapStats stats = cache.lru_map_stats();
+    CHECK_EQ(stats.num_tier_error, 1);
+    CHECK_EQ(cache.SecondTierSize(), 0);
+    for (int64_t idx = 0; idx != 1000; ++idx, ++key) {
+      cache.Insert(key, value);
+    }
+    CHECK(!cache.Find(key - 200));
+    CHECK_EQ(cache.SecondTierSize(), 0);
+    CHECK_EQ(cache.lru_map_stats().num_tier_write, stats.num_tier_write);
+    CHECK(cache.Valid());
+  }
+
+  // While a batch waits for the writer thread, beyond 'max_pending_bytes',
+  // evicted entries are dropped.
+  {
+    LruMapType cache{100};
+    CHECK(cache.OpenSecondTier(
+      "/tmp/lru_map_test_slow_" + std::to_string(getpid()), 16 << 10,
+      4 << 10, 512, 1 /* max_pending_bytes */));
+    for (int64_t key = 0; key != 1000; ++key) {
+      cache.Insert(key, value);
+    }
+    LruMapStats stats = cache.lru_map_stats();
+    CHECK_GT(stats.num_tier_drop, 0);
+    CHECK_EQ(stats.num_tier_write + stats.num_tier_drop, 900);
+    for (int64_t key = 0; key != 1000; ++key) {
+      const std::string *const found = cache.Find(key);
+      CHECK(!found || *found == value);
+    }
+
+    // Once the writer thread catches up, demotions resume.
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    stats = cache.lru_map_stats();
+    cache.Insert(1000, value);
+    CHECK_EQ(cache.lru_map_stats().num_tier_write, stats.num_tier_write + 1);
+    CHECK(cache.Valid());
+  }
+}
+
+
 int main(int argc, char *argv[]) {
   Test1();
   Test2();
   Test3();
   Test4();
   Test5();
+  Test6();
+  Test7();
+  Test8();
+  Test9();
+  Test10();
+  Test11();
+  Test12();
+  Test13();
+  Test14();
 
   LOG(INFO) << "All tests passed";
 }
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include "priority_lru_map.h"
+
+using namespace std;
+
+enum Priority {
+  kBulk = 0,
+  kMetadata = 1,
+  kIndex = 2,
+};
+
+typedef PriorityLruMap<int64_t, std::string, 3> PriorityLruMapType;
+
+
+void Test1() {
+  LOG(INFO) << "Testing eviction by priority";
+  PriorityLruMapType cache{4};
+
+  cache.Insert(1, "index", kIndex);
+  cache.Insert(2, "metadata", kMetadata);
+  for (int64_t key = 10; key != 20; ++key) {
+    cache.Insert(key, "bulk", kBulk);
+  }
+  CHECK_EQ(cache.Size(), 4);
+  CHECK(cache.Exists(1));
+  CHECK(cache.Exists(2));
+  CHECK(cache.Exists(19));
+  CHECK(cache.Exists(18));
+  CHECK(!cache.Exists(17));
+
+  // The bulk pool is drained before the metadata pool, even though its
+  // entries are more recent.
+  cache.Insert(3, "metadata", kMetadata);
+  cache.Insert(4, "metadata", kMetadata);
+  CHECK(!cache.Exists(18));
+  CHECK(!cache.Exists(19));
+  cache.Insert(5, "metadata", kMetadata);
+  CHECK(!cache.Exists(2));
+  CHECK(cache.Exists(1));
+  CHECK_EQ(*cache.Find(1), "index");
+
+  const PriorityLruMapClassStats bulk = cache.class_stats(kBulk);
+  CHECK_EQ(bulk.size, 0);
+  CHECK_EQ(bulk.num_insert, 10);
+  CHECK_EQ(bulk.num_evict, 10);
+  const PriorityLruMapClassStats metadata = cache.class_stats(kMetadata);
+  CHECK_EQ(metadata.size, 3);
+  CHECK_EQ(metadata.num_evict, 1);
+  CHECK_EQ(cache.class_stats(kIndex).num_find_ok, 1);
+  CHECK(cache.Valid());
+
+  // Reinserting moves an entry to another class.
+  cache.Insert(5, "index", kIndex);
+  CHECK_EQ(cache.class_stats(kMetadata).size, 2);
+  CHECK_EQ(cache.class_stats(kIndex).size, 2);
+  CHECK(cache.Valid());
+  LOG(INFO) << cache.ToString();
+}
+
+
+void Test2() {
+  LOG(INFO) << "Testing capacity shares";
+  // The index class may hold at most half of the entries.
+  PriorityLruMapType cache{10, {{1.0, 1.0, 0.5}}};
+  CHECK_EQ(cache.class_stats(kIndex).capacity, 5);
+
+  for (int64_t key = 0; key != 10; ++key) {
+    cache.Insert(key, "index", kIndex);
+  }
+  CHECK_EQ(cache.class_stats(kIndex).size, 5);
+  CHECK_EQ(cache.class_stats(kIndex).num_evict, 5);
+  for (int64_t key = 5; key != 10; ++key) {
+    CHECK(cache.Exists(key));
+  }
+
+  // The other half is left to the lower classes.
+  for (int64_t key = 100; key != 120; ++key) {
+    cache.Insert(key, "bulk", kBulk);
+  }
+  CHECK_EQ(cache.Size(), 10);
+  CHECK_EQ(cache.class_stats(kBulk).size, 5);
+  CHECK_EQ(cache.class_stats(kIndex).size, 5);
+  CHECK(cache.Valid());
+}
+
+
+void Test3() {
+  LOG(INFO) << "Testing pinning";
+  PriorityLruMapType cache{3};
+
+  CHECK(!cache.Pin(1));
+  cache.Insert(1, "one", kBulk);
+  cache.Insert(2, "two", kBulk);
+  CHECK(cache.Pin(1));
+  CHECK_EQ(cache.NumPinned(), 1);
+  CHECK_EQ(cache.class_stats(kBulk).size, 1);
+
+  // The pinned entry survives, and still counts against the capacity.
+  for (int64_t key = 10; key != 20; ++key) {
+    cache.Insert(key, "bulk", kIndex);
+  }
+  CHECK(cache.Exists(1));
+  CHECK_EQ(*cache.Find(1), "one");
+  CHECK_EQ(cache.Size(), 3);
+  CHECK_EQ(cache.class_stats(kIndex).size, 2);
+
+  // With every entry pinned, the map grows beyond its capacity.
+  CHECK(cache.Pin(18));
+  CHECK(cache.Pin(19));
+  cache.Insert(30, "thirty", kBulk);
+  CHECK_EQ(cache.Size(), 4);
+  CHECK(cache.Exists(30));
+  CHECK(cache.Valid());
+
+  // Unpinning makes room again.
+  CHECK(cache.Unpin(1));
+  CHECK(!cache.Unpin(1));
+  CHECK_EQ(cache.Size(), 3);
+  CHECK(cache.Exists(1));
+  CHECK(!cache.Exists(30));
+  CHECK_EQ(cache.NumPinned(), 2);
+
+  cache.Erase(18);
+  CHECK_EQ(cache.NumPinned(), 1);
+  CHECK(cache.Valid());
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.NumPinned(), 0);
+  CHECK(cache.Valid());
+}
+
+
+void Test4() {
+  LOG(INFO) << "Testing random operations";
+  PriorityLruMap<int64_t, int64_t, 3, LockStorageStdMutex,
+    LockExclusiveStd> cache{50, {{1.0, 0.6, 0.3}}};
+  std::mt19937 rng(36);
+  std::uniform_int_distribution<int64_t> keys(0, 200);
+  std::uniform_int_distribution<int> priorities(0, 2);
+  for (int iter = 0; iter != 50000; ++iter) {
+    const int64_t key = keys(rng);
+    switch (iter % 8) {
+      case 0:
+        cache.Erase(key);
+        break;
+      case 1:
+        cache.Pin(key);
+        break;
+      case 2:
+      case 3:
+        cache.Unpin(key);
+        break;
+      case 4:
+      case 5:
+        cache.Insert(key, iter, priorities(rng));
+        break;
+      default:
+        cache.Find(key);
+        break;
+    }
+    // Beyond the capacity, only the pinned entries and the most recent one
+    // remain.
+    CHECK_LE(cache.Size(), std::max(cache.Capacity(), cache.NumPinned() + 1));
+    for (int priority = 0; priority != 3; ++priority) {
+      const PriorityLruMapClassStats stats = cache.class_stats(priority);
+      CHECK_LE(stats.size, stats.capacity);
+    }
+  }
+  CHECK(cache.Valid());
+}
+
+
+int main(int argc, char *argv[]) {
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+
+  LOG(INFO) << "All tests passed";
+}
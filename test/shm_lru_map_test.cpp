@@ -0,0 +1,291 @@
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "shm_lru_map.h"
+
+using namespace std;
+
+struct ShmValue {
+  int64_t value;
+  char tag[8];
+};
+
+// When set, hashing a key ends the process, in the middle of an update that
+// holds the lock of the map.
+static bool die_in_hash = false;
+
+struct DyingHash {
+  size_t operator()(const int64_t key) const {
+    if (die_in_hash) {
+      _exit(0);
+    }
+    return std::hash<int64_t>()(key);
+  }
+};
+
+typedef ShmLruMap<int64_t, ShmValue> ShmLruMapType;
+
+// Return a segment name unique to this process.
+static std::string SegmentName(const std::string& suffix) {
+  return "/shm_lru_map_test_" + std::to_string(getpid()) + "_" + suffix;
+}
+
+
+void Test1() {
+  LOG(INFO) << "Testing basic operations";
+  const std::string name = SegmentName("basic");
+  ShmLruMapType cache{name, 3};
+  CHECK(cache.created());
+  CHECK_EQ(cache.Capacity(), 3);
+  CHECK_EQ(cache.Size(), 0);
+  CHECK(cache.Valid());
+
+  ShmValue value;
+  CHECK(!cache.Find(1, &value));
+  for (int64_t key = 1; key <= 3; ++key) {
+    cache.Insert(key, ShmValue{10 * key, "v"});
+  }
+  CHECK_EQ(cache.Size(), 3);
+
+  // Key 1 becomes the most recent, so key 2 is evicted.
+  CHECK(cache.Find(1, &value));
+  CHECK_EQ(value.value, 10);
+  cache.Insert(4, ShmValue{40, "v"});
+  CHECK(!cache.Exists(2));
+  CHECK(cache.Exists(1));
+  CHECK(cache.Exists(3));
+  CHECK(cache.Exists(4));
+
+  // Overwrite.
+  cache.Insert(3, ShmValue{31, "w"});
+  CHECK(cache.Find(3, &value));
+  CHECK_EQ(value.value, 31);
+  CHECK_EQ(std::string(value.tag), "w");
+  CHECK_EQ(cache.Size(), 3);
+
+  cache.Erase(1);
+  CHECK(!cache.Exists(1));
+  CHECK_EQ(cache.Size(), 2);
+  CHECK(cache.Valid());
+
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  CHECK(cache.Valid());
+
+  const LruMapStats stats = cache.lru_map_stats();
+  CHECK_EQ(stats.num_insert, 5);
+  CHECK_EQ(stats.num_overflow, 1);
+  CHECK_EQ(stats.num_clear, 1);
+  LOG(INFO) << cache.ToString();
+  CHECK(ShmLruMapType::Unlink(name));
+  CHECK(!ShmLruMapType::Unlink(name));
+}
+
+
+void Test2() {
+  LOG(INFO) << "Testing random operations against LruMap";
+  const std::string name = SegmentName("random");
+  const int64_t kCapacity = 100;
+  ShmLruMapType cache{name, kCapacity};
+  LruMap<int64_t, int64_t> reference{kCapacity};
+
+  std::mt19937 rng(34);
+  std::uniform_int_distribution<int64_t> keys(0, 3 * kCapacity);
+  for (int iter = 0; iter != 100000; ++iter) {
+    const int64_t key = keys(rng);
+    const int op = iter % 10;
+    if (op < 5) {
+      ShmValue value;
+      const bool found = cache.Find(key, &value);
+      const int64_t *expected = reference.Find(key);
+      CHECK_EQ(found, expected != nullptr);
+      if (found) {
+        CHECK_EQ(value.value, *expected);
+      }
+    } else if (op < 9) {
+      cache.Insert(key, ShmValue{iter, "r"});
+      reference.Insert(key, iter);
+    } else {
+      cache.Erase(key);
+      reference.Erase(key);
+    }
+    CHECK_EQ(cache.Size(), reference.Size());
+  }
+  CHECK(cache.Valid());
+  CHECK(ShmLruMapType::Unlink(name));
+}
+
+
+void Test3() {
+  LOG(INFO) << "Testing sharing between processes, and reattaching";
+  const std::string name = SegmentName("shared");
+  {
+    ShmLruMapType cache{name, 64};
+    CHECK(cache.created());
+    cache.Insert(1, ShmValue{100, "parent"});
+  }
+
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    ShmLruMapType cache{name, 64};
+    ShmValue value;
+    const bool ok = !cache.created() && cache.Find(1, &value) &&
+                    value.value == 100;
+    cache.Insert(2, ShmValue{200, "child"});
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status));
+  CHECK_EQ(WEXITSTATUS(status), 0);
+
+  // Reattach, as after a restart: the entries written by both processes
+  // are there.
+  ShmLruMapType cache{name, 64};
+  CHECK(!cache.created());
+  ShmValue value;
+  CHECK(cache.Find(1, &value));
+  CHECK_EQ(value.value, 100);
+  CHECK(cache.Find(2, &value));
+  CHECK_EQ(value.value, 200);
+  CHECK_EQ(std::string(value.tag), "child");
+  CHECK_EQ(cache.Size(), 2);
+  CHECK(cache.Valid());
+
+  // After unlinking, a new segment is created.
+  CHECK(ShmLruMapType::Unlink(name));
+  ShmLruMapType new_cache{name, 64};
+  CHECK(new_cache.created());
+  CHECK_EQ(new_cache.Size(), 0);
+  CHECK(ShmLruMapType::Unlink(name));
+}
+
+
+void Test4() {
+  LOG(INFO) << "Testing recovery from a process dying with the lock";
+  typedef ShmLruMap<int64_t, int64_t, DyingHash> DyingMap;
+  const std::string name = SegmentName("robust");
+  DyingMap cache{name, 16};
+  cache.Insert(1, 1);
+
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    die_in_hash = true;
+    cache.Insert(2, 2);
+    _exit(1);
+  }
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status));
+  CHECK_EQ(WEXITSTATUS(status), 0);
+
+  // The map is reset and usable again.
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.num_recovery(), 1);
+  CHECK(cache.Valid());
+  cache.Insert(3, 3);
+  int64_t value;
+  CHECK(cache.Find(3, &value));
+  CHECK_EQ(value, 3);
+  CHECK(DyingMap::Unlink(name));
+}
+
+
+void Test5() {
+  LOG(INFO) << "Testing file backed segment";
+  const std::string path = "/tmp" + SegmentName("file");
+  ShmLruMapType::Unlink(path, ShmLruMapBacking::kFile);
+  {
+    ShmLruMapType cache{path, 8, ShmLruMapBacking::kFile};
+    CHECK(cache.created());
+    cache.Insert(7, ShmValue{70, "file"});
+  }
+  ShmLruMapType cache{path, 8, ShmLruMapBacking::kFile};
+  CHECK(!cache.created());
+  ShmValue value;
+  CHECK(cache.Find(7, &value));
+  CHECK_EQ(value.value, 70);
+  CHECK(ShmLruMapType::Unlink(path, ShmLruMapBacking::kFile));
+}
+
+
+void Test6() {
+  LOG(INFO) << "Testing a segment left uninitialized by its creator";
+  const std::string name = SegmentName("orphan");
+
+  // The creator dies after creating and sizing the segment, with garbage
+  // in it, before publishing it.
+  const pid_t pid = fork();
+  CHECK_GE(pid, 0);
+  if (pid == 0) {
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    const bool ok = fd >= 0 && flock(fd, LOCK_EX) == 0 &&
+                    ftruncate(fd, 1 << 16) == 0;
+    std::string garbage(1 << 16, 'x');
+    garbage.replace(0, 8, 8, '\0');
+    _exit(ok && pwrite(fd, garbage.data(), garbage.size(), 0) ==
+            static_cast<ssize_t>(garbage.size()) ? 0 : 1);
+  }
+  int status;
+  CHECK_EQ(waitpid(pid, &status, 0), pid);
+  CHECK(WIFEXITED(status));
+  CHECK_EQ(WEXITSTATUS(status), 0);
+
+  // The next process initializes it instead.
+  {
+    ShmLruMapType cache{name, 64};
+    CHECK(cache.created());
+    CHECK_EQ(cache.Size(), 0);
+    CHECK(cache.Valid());
+    cache.Insert(1, ShmValue{100, "taken"});
+  }
+  ShmLruMapType cache{name, 64};
+  CHECK(!cache.created());
+  ShmValue value;
+  CHECK(cache.Find(1, &value));
+  CHECK_EQ(value.value, 100);
+  CHECK(ShmLruMapType::Unlink(name));
+
+  // Of processes starting together, exactly one initializes the segment.
+  const int kNumProcesses = 4;
+  std::vector<pid_t> pids;
+  for (int idx = 0; idx != kNumProcesses; ++idx) {
+    pids.push_back(fork());
+    CHECK_GE(pids.back(), 0);
+    if (pids.back() == 0) {
+      ShmLruMapType child_cache{name, 64};
+      child_cache.Insert(idx, ShmValue{idx, "child"});
+      _exit(child_cache.created() ? 10 : 0);
+    }
+  }
+  int num_created = 0;
+  for (const pid_t child : pids) {
+    CHECK_EQ(waitpid(child, &status, 0), child);
+    CHECK(WIFEXITED(status));
+    num_created += WEXITSTATUS(status) == 10;
+  }
+  CHECK_EQ(num_created, 1);
+  ShmLruMapType shared_cache{name, 64};
+  CHECK_EQ(shared_cache.Size(), kNumProcesses);
+  CHECK(ShmLruMapType::Unlink(name));
+}
+
+
+int main(int argc, char *argv[]) {
+  Test1();
+  Test2();
+  Test3();
+  Test4();
+  Test5();
+  Test6();
+
+  LOG(INFO) << "All tests passed";
+}
@@ -0,0 +1,219 @@
+#include <random>
+#include <string>
+#include <vector>
+#include "tenant_lru_map.h"
+
+using namespace std;
+
+typedef TenantLruMap<std::string, int64_t, int64_t> TenantLruMapType;
+
+
+void Test1() {
+  LOG(INFO) << "Testing isolation from a scanning tenant";
+  TenantLruMapType cache{100};
+
+  for (int64_t key = 0; key != 30; ++key) {
+    cache.Insert("alice", key, key);
+    cache.Insert("bob", key, key);
+  }
+  CHECK_EQ(cache.Size(), 60);
+
+  // Once 'mallory' holds more entries than the others, it evicts its own.
+  for (int64_t key = 0; key != 1000; ++key) {
+    cache.Insert("mallory", key, key);
+  }
+  CHECK_EQ(cache.Size(), 100);
+  for (int64_t key = 0; key != 30; ++key) {
+    CHECK_EQ(*cache.Find("alice", key), key);
+    CHECK(cache.Exists("bob", key));
+  }
+  CHECK(!cache.Exists("mallory", 0));
+  CHECK(cache.Exists("mallory", 999));
+
+  const TenantLruMapTenantStats mallory = cache.tenant_stats("mallory");
+  CHECK_EQ(mallory.size, 40);
+  CHECK_EQ(mallory.num_insert, 1000);
+  CHECK_EQ(mallory.num_evict, 960);
+  const TenantLruMapTenantStats alice = cache.tenant_stats("alice");
+  CHECK_EQ(alice.size, 30);
+  CHECK_EQ(alice.num_find_ok, 30);
+  CHECK_EQ(alice.num_evict, 0);
+  CHECK_EQ(cache.tenant_stats("bob").num_evict, 0);
+
+  // The same key of another tenant is another entry.
+  CHECK(cache.Find("bob", 999) == nullptr);
+  CHECK_EQ(cache.tenant_stats("bob").num_find_miss, 1);
+  // A tenant unknown to the map is not added by a miss.
+  CHECK(cache.Find("carol", 1) == nullptr);
+  CHECK_EQ(cache.tenant_stats("carol").num_find_miss, 0);
+  CHECK_EQ(cache.NumTenants(), 3);
+  CHECK_EQ(cache.tenant_stats("dave").quota, 100);
+  CHECK_EQ(cache.NumTenants(), 3);
+  CHECK_EQ(cache.lru_map_stats().num_find - cache.lru_map_stats().num_find_ok,
+           2);
+
+  // Refreshing an entry neither grows the tenant nor evicts.
+  cache.Insert("alice", 0, 100);
+  CHECK_EQ(*cache.Find("alice", 0), 100);
+  CHECK_EQ(cache.tenant_stats("alice").size, 30);
+  CHECK_EQ(cache.lru_map_stats().num_overflow, 960);
+  CHECK(cache.Valid());
+}
+
+
+void Test2() {
+  LOG(INFO) << "Testing reservations and quotas";
+  TenantLruMapType cache{100};
+  cache.SetTenantLimits("alice", 80, 100);
+  CHECK_EQ(cache.tenant_stats("alice").reservation, 80);
+
+  for (int64_t key = 0; key != 80; ++key) {
+    cache.Insert("alice", key, key);
+  }
+  for (int64_t key = 0; key != 20; ++key) {
+    cache.Insert("bob", key, key);
+  }
+
+  // 'alice' is the largest tenant, but within its reservation, so the
+  // others share what is left.
+  for (int64_t key = 0; key != 100; ++key) {
+    cache.Insert("carol", key, key);
+  }
+  CHECK_EQ(cache.tenant_stats("alice").size, 80);
+  CHECK_EQ(cache.tenant_stats("alice").num_evict, 0);
+  CHECK_EQ(cache.tenant_stats("bob").size, 10);
+  CHECK_EQ(cache.tenant_stats("carol").size, 10);
+  CHECK(cache.Valid());
+
+  // Beyond its reservation, 'alice' competes like the others.
+  for (int64_t key = 80; key != 90; ++key) {
+    cache.Insert("alice", key, key);
+  }
+  CHECK_EQ(cache.tenant_stats("alice").size, 86);
+  CHECK_EQ(cache.tenant_stats("bob").size, 7);
+  CHECK_EQ(cache.tenant_stats("carol").size, 7);
+  CHECK(cache.Valid());
+
+  // A quota caps a tenant even when there is room.
+  cache.Clear();
+  CHECK_EQ(cache.Size(), 0);
+  cache.SetTenantLimits("bob", 0, 5);
+  for (int64_t key = 0; key != 20; ++key) {
+    cache.Insert("bob", key, key);
+  }
+  CHECK_EQ(cache.tenant_stats("bob").size, 5);
+  for (int64_t key = 15; key != 20; ++key) {
+    CHECK(cache.Exists("bob", key));
+  }
+
+  // Lowering the quota evicts the least recent entries.
+  cache.Find("bob", 15);
+  cache.SetTenantLimits("bob", 0, 2);
+  CHECK_EQ(cache.tenant_stats("bob").size, 2);
+  CHECK(cache.Exists("bob", 15));
+  CHECK(cache.Exists("bob", 19));
+  CHECK(cache.Valid());
+
+  cache.ClearTenant("bob");
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.tenant_stats("bob").quota, 2);
+  CHECK(cache.Valid());
+
+  // Erasing a tenant forgets it, and releases its reservation.
+  for (int64_t key = 0; key != 100; ++key) {
+    cache.Insert("alice", key, key);
+  }
+  CHECK_EQ(cache.NumTenants(), 3);
+  cache.EraseTenant("alice");
+  CHECK_EQ(cache.Size(), 0);
+  CHECK_EQ(cache.NumTenants(), 2);
+  CHECK_EQ(cache.tenant_stats("alice").reservation, 0);
+  CHECK_EQ(cache.tenant_stats("alice").num_insert, 0);
+  cache.SetTenantLimits("carol", 100, 100);
+  CHECK(cache.Valid());
+  LOG(INFO) << cache.ToString();
+}
+
+
+void Test3() {
+  LOG(INFO) << "Testing random operations";
+  const int kNumTenants = 8;
+  TenantLruMap<int, int64_t, int64_t, LockStorageStdMutex,
+    LockExclusiveStd> cache{60};
+  std::mt19937 rng(38);
+  for (int tenant = 0; tenant != kNumTenants; ++tenant) {
+    cache.SetTenantLimits(tenant, tenant, 10 + 5 * tenant);
+  }
+
+  std::uniform_int_distribution<int> tenants(0, kNumTenants - 1);
+  std::uniform_int_distribution<int64_t> keys(0, 40);
+  std::vector<TenantLruMapTenantStats> before(kNumTenants);
+  for (int iter = 0; iter != 50000; ++iter) {
+    const int tenant = tenants(rng);
+    const int64_t key = keys(rng);
+    switch (iter % 16) {
+      case 0:
+        cache.Erase(tenant, key);
+        break;
+      case 1:
+        if (iter % 1024 == 1) {
+          cache.ClearTenant(tenant);
+        } else if (iter % 4096 == 17) {
+          // Forget the tenant, then restore its limits.
+          cache.EraseTenant(tenant);
+          cache.SetTenantLimits(tenant, tenant, 10 + 5 * tenant);
+        }
+        break;
+      case 2:
+      case 3:
+      case 4:
+        cache.Find(tenant, key);
+        break;
+      default: {
+        for (int t = 0; t != kNumTenants; ++t) {
+          before[t] = cache.tenant_stats(t);
+        }
+        const bool exists = cache.Exists(tenant, key);
+        const int64_t size = cache.Size();
+        cache.Insert(tenant, key, iter);
+        if (exists) {
+          break;
+        }
+        before[tenant].size += 1;
+
+        // Compare the victim against a search of all tenants.
+        int victim = -1;
+        int64_t max_excess = 0;
+        for (int t = 0; t != kNumTenants; ++t) {
+          if (cache.tenant_stats(t).num_evict != before[t].num_evict) {
+            CHECK_EQ(victim, -1);
+            victim = t;
+          }
+          max_excess = std::max(max_excess,
+                                before[t].size - before[t].reservation);
+        }
+        if (before[tenant].size > before[tenant].quota) {
+          CHECK_EQ(victim, tenant);
+        } else if (size == cache.Capacity()) {
+          CHECK_NE(victim, -1);
+          CHECK_EQ(before[victim].size - before[victim].reservation,
+                   max_excess);
+        } else {
+          CHECK_EQ(victim, -1);
+        }
+        break;
+      }
+    }
+    CHECK_LE(cache.Size(), cache.Capacity());
+  }
+  CHECK(cache.Valid());
+}
+
+
+int main(int argc, char *argv[]) {
+  Test1();
+  Test2();
+  Test3();
+
+  LOG(INFO) << "All tests passed";
+}
@@ -0,0 +1,185 @@
+#include <random>
+#include <thread>
+#include <vector>
+#include "thread_cached_lru_map.h"
+
+using namespace std;
+
+typedef ThreadCachedLruMap<LruMap<int64_t, int64_t>> MyCacheType;
+
+
+void TestBasic() {
+  LOG(INFO) << "Testing invalidation";
+  MyCacheType cache{4};
+  int64_t value = 0;
+
+  CHECK(!cache.Find(1, &value));
+  cache.Insert(1, 10);
+  CHECK(cache.Find(1, &value));  // L2 hit, fills L1.
+  CHECK_EQ(value, 10);
+  CHECK(cache.Find(1, &value));  // L1 hit.
+  CHECK_EQ(value, 10);
+
+  // An update is seen right away.
+  cache.Insert(1, 11);
+  CHECK(cache.Find(1, &value));
+  CHECK_EQ(value, 11);
+  CHECK(cache.Find(1, &value));
+  CHECK_EQ(value, 11);
+
+  cache.Erase(1);
+  CHECK(!cache.Find(1, &value));
+
+  cache.Insert(2, 20);
+  CHECK(cache.Find(2, &value));
+  cache.Clear();
+  CHECK(!cache.Find(2, &value));
+  CHECK_EQ(cache.Size(), 0);
+
+  // Another object of the same type never sees these L1 slots.
+  MyCacheType other{4};
+  cache.Insert(3, 30);
+  CHECK(cache.Find(3, &value));
+  CHECK(!other.Find(3, &value));
+
+  const ThreadCachedLruMapStats stats = cache.thread_cached_stats();
+  LOG(INFO) << "Stats: " << stats.ToString();
+  CHECK_EQ(stats.num_l1_hit, 2);
+  CHECK_EQ(stats.num_l2_hit, 4);
+  CHECK_EQ(stats.num_miss, 3);
+}
+
+
+void TestTtl() {
+  LOG(INFO) << "Testing L1 TTL";
+  MyCacheType cache{4, 1000 /* l1_ttl_usecs */};
+  int64_t value = 0;
+  cache.Insert(1, 10);
+  CHECK(cache.Find(1, &value));
+  CHECK(cache.Find(1, &value));
+  usleep(2000);
+  CHECK(cache.Find(1, &value));
+  const ThreadCachedLruMapStats stats = cache.thread_cached_stats();
+  CHECK_EQ(stats.num_l1_hit, 1);
+  CHECK_EQ(stats.num_l2_hit, 2);
+}
+
+
+void TestRecency() {
+  LOG(INFO) << "Testing L2 recency of L1 hits";
+  for (const int64_t l1_max_hits : {0, 4}) {
+    MyCacheType cache{8, 0 /* l1_ttl_usecs */, l1_max_hits};
+    int64_t value = 0;
+    cache.Insert(1, 10);
+    for (int64_t key = 2; key != 100; ++key) {
+      cache.Insert(key, key);
+      CHECK(cache.Find(1, &value));
+      CHECK_EQ(value, 10);
+    }
+
+    // Another thread has no L1 copy, and looks in the shared map, which
+    // kept the key only if L1 hits refreshed it.
+    bool found = false;
+    std::thread{[&cache, &found] {
+      int64_t other_value = 0;
+      found = cache.Find(1, &other_value);
+    }}.join();
+    CHECK_EQ(found, l1_max_hits != 0);
+
+    const ThreadCachedLruMapStats stats = cache.thread_cached_stats();
+    if (l1_max_hits != 0) {
+      CHECK_GE(stats.num_l2_hit, 98 / (l1_max_hits + 1));
+    }
+  }
+}
+
+
+void TestL1Ratio() {
+  LOG(INFO) << "Testing share of lookups served by L1";
+  const int64_t kNumKeys = 64;
+  const int64_t kL1MaxHits = 64;
+  const int64_t kNumRepeats = 10 * (kL1MaxHits + 1);
+  MyCacheType cache{1000, 0 /* l1_ttl_usecs */, kL1MaxHits};
+  for (int64_t key = 0; key != kNumKeys; ++key) {
+    cache.Insert(key, key);
+  }
+
+  // Looked up over and over, a key is read from the shared map, under its
+  // lock, once every kL1MaxHits + 1 lookups.
+  int64_t value = 0;
+  for (int64_t key = 0; key != kNumKeys; ++key) {
+    for (int64_t lookup = 0; lookup != kNumRepeats; ++lookup) {
+      CHECK(cache.Find(key, &value));
+      CHECK_EQ(value, key);
+    }
+  }
+  const ThreadCachedLruMapStats stats = cache.thread_cached_stats();
+  CHECK_EQ(stats.num_l2_hit, kNumKeys * kNumRepeats / (kL1MaxHits + 1));
+  CHECK_EQ(stats.num_l1_hit, kNumKeys * kNumRepeats - stats.num_l2_hit);
+  CHECK_EQ(cache.lru_map_stats().num_find, stats.num_l2_hit);
+}
+
+
+// Readers look up a small set of hot keys while a writer keeps updating
+// them. Each value encodes its key, and every update of a key increases its
+// value, so a reader must never see a value older than what the writer had
+// published before the reader started.
+void TestConcurrent() {
+  LOG(INFO) << "Testing concurrent skewed workload";
+  const int64_t kNumHotKeys = 64;
+  const int64_t kNumLookups = 200000;
+  MyCacheType cache{1000};
+  for (int64_t key = 0; key != kNumHotKeys; ++key) {
+    cache.Insert(key, key);
+  }
+
+  std::atomic<bool> done{false};
+  std::thread writer{[&cache, &done] {
+    int64_t round = 1;
+    while (!done.load()) {
+      for (int64_t key = 0; key < kNumHotKeys; key += 7) {
+        cache.Insert(key, round * 1000 + key);
+      }
+      ++round;
+      usleep(100);
+    }
+  }};
+
+  std::vector<std::thread> readers;
+  for (int thread_index = 0; thread_index != 4; ++thread_index) {
+    readers.emplace_back([&cache, thread_index] {
+      std::default_random_engine generator(thread_index);
+      std::uniform_int_distribution<int64_t> distribution{0, kNumHotKeys - 1};
+      std::vector<int64_t> last_seen(kNumHotKeys, 0);
+      for (int64_t lookup = 0; lookup != kNumLookups; ++lookup) {
+        const int64_t key = distribution(generator);
+        int64_t value = -1;
+        CHECK(cache.Find(key, &value));
+        CHECK_EQ(value % 1000, key);
+        CHECK_GE(value, last_seen[key]);
+        last_seen[key] = value;
+      }
+    });
+  }
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  done.store(true);
+  writer.join();
+
+  const ThreadCachedLruMapStats stats = cache.thread_cached_stats();
+  LOG(INFO) << "Stats: " << stats.ToString();
+  LOG(INFO) << "Shared map stats: " << cache.lru_map_stats().ToString();
+  CHECK_EQ(stats.num_l1_hit + stats.num_l2_hit, 4 * kNumLookups);
+}
+
+
+int main(int argc, char *argv[]) {
+  TestBasic();
+  TestTtl();
+  TestRecency();
+  TestL1Ratio();
+  TestConcurrent();
+
+  LOG(INFO) << "All tests passed";
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright: Arun Saha <arunksaha@gmail.com>
+ *
+ * This file provides ThreadCachedLruMap, a two level cache: a small, lock
+ * free, per-thread front cache (L1) in front of a shared LruMap (L2).
+ *
+ * With a skewed workload most lookups are for a few hundred hot keys, yet
+ * every one of them takes the lock of the shared map and reorders its
+ * global usage list. ThreadCachedLruMap serves those lookups from a direct
+ * mapped array of 'kNumL1Slots' copies of entries that is private to the
+ * calling thread, and goes to the shared map only on an L1 miss.
+ *
+ * Invalidation. The key space is hashed into a number of version stripes,
+ * each an atomic counter. Insert(), Erase() and Clear() bump the versions
+ * of the stripes they touch after updating the shared map. An L1 slot
+ * remembers the version of its stripe as read before the shared map was
+ * consulted, and is served only while that version is still current. So
+ * once Insert() or Erase() returns, no thread sees the previous value.
+ *
+ * Recency. An L1 hit does not touch the shared map, so to its usage list
+ * the hottest keys would look cold, and be the first evicted. Therefore an
+ * L1 slot serves at most 'l1_max_hits' lookups; the next one goes to the
+ * shared map, which refreshes the recency of the entry, and refills the
+ * slot. The shared lock is then taken once every 'l1_max_hits' + 1 lookups
+ * of a hot key rather than on every one: a lower value keeps the shared
+ * usage order more accurate, a higher one takes the lock less often.
+ *
+ * Staleness. The shared map may also drop an entry on its own, through
+ * overflow. The L1 copy then stays servable; it still holds the most
+ * recently written value of the key. Such a copy is served for at most
+ * 'l1_ttl_usecs' after it was filled, and at most 'l1_max_hits' times. The
+ * time limit costs a clock read per L1 hit; 0 disables it.
+ *
+ * The shared map is protected by a mutex of this class, so LruMapType is
+ * better instantiated with the default, non-locking, policies. All updates
+ * must go through this class. ValueType must be copy constructible and
+ * copy assignable.
+ *
+ * The L1 array of a thread is shared by all objects of the same
+ * ThreadCachedLruMap type; every slot is tagged with the object that filled
+ * it, so objects never see each other's slots.
+ */
+
+#ifndef _THREAD_CACHED_LRU_MAP_H_
+#define _THREAD_CACHED_LRU_MAP_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+
+#include "lru_map.h"
+
+// Counters of ThreadCachedLruMap lookups.
+struct ThreadCachedLruMapStats {
+  int64_t num_l1_hit{0};  // # of Find() calls served by the per-thread cache.
+  int64_t num_l2_hit{0};  // # of Find() calls served by the shared map.
+  int64_t num_miss{0};    // # of Find() calls that found nothing.
+  std::string ToString() const;
+};
+
+template <class LruMapType, int64_t kNumL1Slots = 256>
+class ThreadCachedLruMap {
+ public:
+  static_assert(kNumL1Slots >= 1 && (kNumL1Slots & (kNumL1Slots - 1)) == 0,
+                "kNumL1Slots must be a power of 2");
+
+  typedef typename LruMapType::key_type KeyType;
+  typedef typename LruMapType::mapped_type ValueType;
+
+  // Construct an object whose shared map has the specified 'capacity'. An
+  // L1 slot is served for at most 'l1_ttl_usecs' after it was filled, and
+  // for at most 'l1_max_hits' lookups, see above; 0 lifts either limit.
+  // 'num_version_stripes' is rounded up to a power of 2.
+  explicit ThreadCachedLruMap(int64_t capacity,
+                              int64_t l1_ttl_usecs = 100000,
+                              int64_t l1_max_hits = 64,
+                              int64_t num_version_stripes = 1024);
+
+  ~ThreadCachedLruMap() = default;
+
+  // Insert or update an entry, see LruMap::Insert().
+  void Insert(const KeyType& key, const ValueType& value);
+
+  // Find the entry, if exists, for the key 'key' and copy its value to
+  // '*value'. Return true iff found.
+  bool Find(const KeyType& key, ValueType *value);
+
+  // Erase entry with key 'key', if exists.
+  void Erase(const KeyType& key);
+
+  // Clear all entries in the map.
+  void Clear();
+
+  // Return the capacity of the shared map.
+  int64_t Capacity() const;
+
+  // Return the current number of entries in the shared map.
+  int64_t Size() const;
+
+  // Return the L1 and L2 lookup counters, summed over all threads.
+  ThreadCachedLruMapStats thread_cached_stats() const;
+
+  // Return a copy of the statistics of the shared map. Its 'num_find'
+  // counts the lookups that needed the shared lock.
+  LruMapStats lru_map_stats() const;
+
+ private:
+  // A cached copy of an entry.
+  struct L1Slot {
+    // The object that filled this slot, 0 if the slot is empty.
+    uint64_t owner_id{0};
+
+    // The version of the stripe of the key when the slot was filled.
+    uint64_t version{0};
+
+    // When the slot was filled, only maintained if there is a TTL.
+    int64_t fill_usecs{0};
+
+    // The number of lookups served from the slot since it was filled.
+    int64_t num_hits{0};
+
+    // Storage for the key and the value, constructed iff owner_id != 0.
+    typename std::aligned_storage<sizeof(std::pair<KeyType, ValueType>),
+      alignof(std::pair<KeyType, ValueType>)>::type storage;
+
+    std::pair<KeyType, ValueType>& kv() {
+      return *reinterpret_cast<std::pair<KeyType, ValueType> *>(&storage);
+    }
+  };
+
+  struct L1Cache {
+    L1Slot slots[kNumL1Slots];
+    ~L1Cache() {
+      for (L1Slot& slot : slots) {
+        if (slot.owner_id != 0) {
+          slot.kv().~pair();
+        }
+      }
+    }
+  };
+
+  // Lookup counters, aligned to a cache line each to keep threads from
+  // contending on them.
+  struct alignas(64) Counters {
+    std::atomic<int64_t> num_l1_hit{0};
+    std::atomic<int64_t> num_l2_hit{0};
+    std::atomic<int64_t> num_miss{0};
+  };
+  static constexpr int kNumCounters = 16;
+
+  // Return the L1 array of the calling thread.
+  static L1Cache& LocalL1Cache();
+
+  // Return the counters for the calling thread.
+  Counters& LocalCounters();
+
+  // Return a well mixed hash of 'key'.
+  static uint64_t HashOf(const KeyType& key);
+
+  std::atomic<uint64_t>& StripeOf(uint64_t hash) {
+    return versions_[(hash >> 32) & (num_version_stripes_ - 1)];
+  }
+
+  // Return the current time if there is a TTL, 0 otherwise.
+  int64_t NowUsecs() const;
+
+ private:
+  // Unique, non-zero, identity of this object in the L1 slots.
+  const uint64_t id_;
+
+  const int64_t l1_ttl_usecs_;
+  const int64_t l1_max_hits_;
+
+  int64_t num_version_stripes_{1};
+  std::unique_ptr<std::atomic<uint64_t>[]> versions_;
+
+  Counters counters_[kNumCounters];
+
+  // Protects 'shared_map_'.
+  mutable std::mutex mutex_;
+  LruMapType shared_map_;
+};
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::ThreadCachedLruMap(
+  const int64_t capacity, const int64_t l1_ttl_usecs,
+  const int64_t l1_max_hits, const int64_t num_version_stripes) :
+  id_{[] {
+    static std::atomic<uint64_t> next_id{1};
+    return next_id.fetch_add(1);
+  }()},
+  l1_ttl_usecs_{l1_ttl_usecs},
+  l1_max_hits_{l1_max_hits},
+  shared_map_{capacity} {
+  CHECK_GE(l1_ttl_usecs, 0);
+  CHECK_GE(l1_max_hits, 0);
+  CHECK_GE(num_version_stripes, 1);
+  while (num_version_stripes_ < num_version_stripes) {
+    num_version_stripes_ *= 2;
+  }
+  versions_.reset(new std::atomic<uint64_t>[num_version_stripes_]);
+  for (int64_t stripe = 0; stripe != num_version_stripes_; ++stripe) {
+    versions_[stripe].store(0, std::memory_order_relaxed);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+void
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::Insert(const KeyType& key,
+                                                     const ValueType& value) {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    shared_map_.Insert(key, value);
+  }
+  // Bumped after the update, so that a concurrent Find() either copies the
+  // new value or tags its copy with a version that is now stale.
+  StripeOf(HashOf(key)).fetch_add(1, std::memory_order_release);
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+bool
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::Find(const KeyType& key,
+                                                   ValueType *const value) {
+  const uint64_t hash = HashOf(key);
+  const uint64_t version = StripeOf(hash).load(std::memory_order_acquire);
+  L1Slot& slot = LocalL1Cache().slots[hash & (kNumL1Slots - 1)];
+  Counters& counters = LocalCounters();
+
+  if (slot.owner_id == id_ && slot.version == version &&
+      slot.kv().first == key &&
+      (l1_max_hits_ == 0 || slot.num_hits < l1_max_hits_) &&
+      (l1_ttl_usecs_ == 0 || NowUsecs() - slot.fill_usecs <= l1_ttl_usecs_)) {
+    ++slot.num_hits;
+    *value = slot.kv().second;
+    counters.num_l1_hit.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    const ValueType *shared_value = shared_map_.Find(key);
+    if (!shared_value) {
+      counters.num_miss.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *value = *shared_value;
+  }
+  counters.num_l2_hit.fetch_add(1, std::memory_order_relaxed);
+
+  // Fill the slot with the version read before the shared map was
+  // consulted; if an update raced with this lookup the copy is never served.
+  if (slot.owner_id != 0) {
+    slot.kv().~pair();
+  }
+  new (&slot.storage) std::pair<KeyType, ValueType>{key, *value};
+  slot.owner_id = id_;
+  slot.version = version;
+  slot.fill_usecs = NowUsecs();
+  slot.num_hits = 0;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+void
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::Erase(const KeyType& key) {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    shared_map_.Erase(key);
+  }
+  StripeOf(HashOf(key)).fetch_add(1, std::memory_order_release);
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+void
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::Clear() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    shared_map_.Clear();
+  }
+  for (int64_t stripe = 0; stripe != num_version_stripes_; ++stripe) {
+    versions_[stripe].fetch_add(1, std::memory_order_release);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+inline int64_t
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::Capacity() const {
+  return shared_map_.Capacity();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+inline int64_t
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::Size() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shared_map_.Size();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+ThreadCachedLruMapStats
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::thread_cached_stats() const {
+  ThreadCachedLruMapStats stats;
+  for (const Counters& counters : counters_) {
+    stats.num_l1_hit += counters.num_l1_hit.load(std::memory_order_relaxed);
+    stats.num_l2_hit += counters.num_l2_hit.load(std::memory_order_relaxed);
+    stats.num_miss += counters.num_miss.load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+inline LruMapStats
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::lru_map_stats() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return shared_map_.lru_map_stats();
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+typename ThreadCachedLruMap<LruMapType, kNumL1Slots>::L1Cache&
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::LocalL1Cache() {
+  static thread_local L1Cache l1_cache;
+  return l1_cache;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+typename ThreadCachedLruMap<LruMapType, kNumL1Slots>::Counters&
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::LocalCounters() {
+  static std::atomic<int> next_thread_index{0};
+  static thread_local const int thread_index =
+    next_thread_index.fetch_add(1, std::memory_order_relaxed);
+  return counters_[thread_index % kNumCounters];
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+inline uint64_t
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::HashOf(const KeyType& key) {
+  // std::hash is the identity for integers on common implementations, so the
+  // bits are mixed before they are used for the slot and the stripe.
+  uint64_t hash = static_cast<uint64_t>(std::hash<KeyType>()(key));
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// ----------------------------------------------------------------------------
+
+template <class LruMapType, int64_t kNumL1Slots>
+inline int64_t
+ThreadCachedLruMap<LruMapType, kNumL1Slots>::NowUsecs() const {
+  if (l1_ttl_usecs_ == 0) {
+    return 0;
+  }
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ----------------------------------------------------------------------------
+
+inline std::string ThreadCachedLruMapStats::ToString() const {
+  std::ostringstream oss;
+  oss << "num_l1_hit = " << num_l1_hit;
+  oss << ", num_l2_hit = " << num_l2_hit;
+  oss << ", num_miss = " << num_miss;
+  return oss.str();
+}
+
+// ----------------------------------------------------------------------------
+
+#endif // _THREAD_CACHED_LRU_MAP_H_